@@ -26,11 +26,26 @@
 
 #include "execute.h"
 #include "memchr2.h"
-#include "regex.h"
 #include "spawn-pipe.h"
 #include "wait-process.h"
 
+/* Use the two-way algorithm that gnulib's strstr is built on for
+   find_substring, which unlike strstr must not stop at NUL.  */
+#define RETURN_TYPE void *
+#define AVAILABLE(h, h_l, j, n_l) ((j) <= (h_l) - (n_l))
+#include "str-two-way.h"
+
+/* With SSE2, find_substring first filters candidate positions 16 at
+   a time.  */
+#if defined __SSE2__ && __GNUC__ > 3
+# include <emmintrin.h>
+# define FILTER_SUBSTRING 1
+#else
+# define FILTER_SUBSTRING 0
+#endif
+
 #define ARG(i) (argc > (i) ? TOKEN_DATA_TEXT (argv[i]) : "")
+#define ARG_LEN(i) (argc > (i) ? TOKEN_DATA_LEN (argv[i]) : 0)
 
 /* Initialization of builtin and predefined macros.  The table
    "builtin_tab" is both used for initialization, and by the "builtin"
@@ -186,6 +201,52 @@ find_builtin_by_addr (builtin_func *func)
   return NULL;
 }
 
+/* A perfect hash of the names in builtin_tab: slot hash_text (NAME,
+   LEN, builtin_hash_seed) % BUILTIN_HASH_SIZE holds one plus the index
+   of the builtin named NAME, and no two builtins share a slot.  The
+   seed is searched for on first use, since the table contents depend
+   on the configuration, and the hash values on the byte order.  */
+#define BUILTIN_HASH_SIZE 1024
+#define BUILTIN_HASH_SEEDS 1000
+
+static unsigned char builtin_hash[BUILTIN_HASH_SIZE];
+static size_t builtin_hash_seed;
+static size_t builtin_count;
+
+/*-----------------------------------------------------------------.
+| Find a seed for which the names of all builtins hash to distinct |
+| slots, and fill in builtin_hash accordingly.                     |
+`-----------------------------------------------------------------*/
+
+static void
+init_builtin_hash (void)
+{
+  const builtin *bp;
+  size_t slot;
+
+  for (builtin_hash_seed = 0; builtin_hash_seed < BUILTIN_HASH_SEEDS;
+       builtin_hash_seed++)
+    {
+      memset (builtin_hash, 0, sizeof builtin_hash);
+      for (bp = &builtin_tab[0]; bp->name != NULL; bp++)
+        {
+          slot = (hash_text (bp->name, strlen (bp->name), builtin_hash_seed)
+                  % BUILTIN_HASH_SIZE);
+          if (builtin_hash[slot] != 0)
+            break;
+          builtin_hash[slot] = bp - builtin_tab + 1;
+        }
+      if (bp->name == NULL)
+        {
+          builtin_count = bp - builtin_tab;
+          return;
+        }
+    }
+  M4ERROR ((warning_status, 0,
+            "INTERNAL ERROR: no perfect hash for the builtin table"));
+  abort ();
+}
+
 /*----------------------------------------------------------.
 | Find the builtin, which has NAME.  On failure, return the |
 | placeholder builtin.                                      |
@@ -194,12 +255,16 @@ find_builtin_by_addr (builtin_func *func)
 const builtin *
 find_builtin_by_name (const char *name)
 {
-  const builtin *bp;
+  size_t len = strlen (name);
+  int i;
 
-  for (bp = &builtin_tab[0]; bp->name != NULL; bp++)
-    if (STREQ (bp->name, name))
-      return bp;
-  return bp + 1;
+  if (builtin_count == 0)
+    init_builtin_hash ();
+  i = builtin_hash[hash_text (name, len, builtin_hash_seed)
+                   % BUILTIN_HASH_SIZE];
+  if (i != 0 && STREQ (builtin_tab[i - 1].name, name))
+    return &builtin_tab[i - 1];
+  return &builtin_tab[builtin_count + 1];
 }
 
 /*----------------------------------------------------------------.
@@ -213,21 +278,58 @@ define_builtin (const char *name, const builtin *bp, symbol_lookup mode)
   symbol *sym;
 
   sym = lookup_symbol (name, mode);
+  if (SYMBOL_TYPE (sym) == TOKEN_TEXT)
+    free (SYMBOL_TEXT (sym));
+  free (SYMBOL_PIECES (sym));
+  SYMBOL_PIECES (sym) = NULL;
   SYMBOL_TYPE (sym) = TOKEN_FUNC;
   SYMBOL_MACRO_ARGS (sym) = bp->groks_macro_args;
   SYMBOL_BLIND_NO_ARGS (sym) = bp->blind_if_no_args;
   SYMBOL_FUNC (sym) = bp->func;
 }
 
-/* Storage for the compiled regular expression of
-   --warn-macro-sequence.  */
-static struct re_pattern_buffer macro_sequence_buf;
-
-/* Storage for the matches of --warn-macro-sequence.  */
-static struct re_registers macro_sequence_regs;
+/* The compiled regular expression of --warn-macro-sequence, or NULL
+   if it is not in effect.  */
+static pattern_buffer *macro_sequence;
+
+/* Macro libraries tend to call regexp and patsubst in loops with a
+   few constant patterns, so the most recently compiled regular
+   expressions are kept in a cache, most recent first.  The cache is
+   bounded both in entries and in the total length of the patterns,
+   which stands for the memory of their compiled form; longer patterns
+   are compiled for each use.  */
+#define REGEX_CACHE_SIZE 16
+#define REGEX_CACHE_BYTES (16 * 1024)
+
+static pattern_buffer *regex_cache[REGEX_CACHE_SIZE];
+static int regex_cache_count;
+static size_t regex_cache_bytes;
+
+/* Statistics for the `s' debug flag.  */
+static unsigned long regex_cache_hits;
+static unsigned long regex_cache_misses;
+
+/* Macros that change the case of identifiers, or mangle them, call
+   translit over and over with the same few pairs of FROM and TO
+   arguments, so the most recently built translation tables are kept,
+   most recent first.  */
+#define TRANSLIT_CACHE_SIZE 8
+
+typedef struct translit_table translit_table;
+
+struct translit_table
+{
+  char *from;                   /* FROM, before ranges are expanded */
+  size_t from_len;              /* length of from */
+  char *to;                     /* TO, likewise */
+  size_t to_len;                /* length of to */
+  bool deletes_only;            /* no byte is replaced by another */
+  unsigned char map[UCHAR_MAX + 1]; /* what each byte becomes */
+  unsigned char keep[UCHAR_MAX + 1]; /* 0 if the byte is deleted */
+};
 
-/* True if --warn-macro-sequence is in effect.  */
-static bool macro_sequence_inuse;
+static translit_table *translit_cache[TRANSLIT_CACHE_SIZE];
+static int translit_cache_count;
 
 /*----------------------------------------.
 | Clean up regular expression variables.  |
@@ -241,6 +343,114 @@ free_pattern_buffer (struct re_pattern_buffer *buf, struct re_registers *regs)
   free (regs->end);
 }
 
+/*-------------------------------------------------------------------.
+| Release a reference to PATTERN, obtained from compile_pattern, and |
+| free it once the last one is gone.                                 |
+`-------------------------------------------------------------------*/
+
+void
+free_pattern (pattern_buffer *pattern)
+{
+  if (--pattern->refs == 0)
+    {
+      free_pattern_buffer (&pattern->buf, &pattern->regs);
+      free (pattern->str);
+      free (pattern);
+    }
+}
+
+/* Return true if the LEN bytes of STR contain no operator of the
+   default regular expression syntax, so that they only match
+   themselves.  NUL is treated as an operator, to stay on the safe
+   side.  */
+static bool
+literal_pattern (const char *str, size_t len)
+{
+  while (len--)
+    if (strchr ("\\.[*+?^$", *str++))
+      return false;
+  return true;
+}
+
+/*-------------------------------------------------------------------.
+| Compile the regular expression STR of length LEN, or reuse it from |
+| the cache if it was compiled with the same syntax.  Return it with |
+| a reference that the caller releases with free_pattern, or return  |
+| NULL and set *MSG to the reason if STR is not valid.  The fastmap  |
+| of the result is always up to date.                               |
+`-------------------------------------------------------------------*/
+
+pattern_buffer *
+compile_pattern (const char *str, size_t len, const char **msg)
+{
+  pattern_buffer *pattern;
+  int i;
+
+  for (i = 0; i < regex_cache_count; i++)
+    {
+      pattern = regex_cache[i];
+      if (pattern->len == len && pattern->syntax == re_syntax_options
+          && memcmp (pattern->str, str, len) == 0)
+        {
+          memmove (regex_cache + 1, regex_cache, i * sizeof *regex_cache);
+          regex_cache[0] = pattern;
+          regex_cache_hits++;
+          pattern->refs++;
+          return pattern;
+        }
+    }
+  regex_cache_misses++;
+
+  pattern = (pattern_buffer *) xmalloc (sizeof *pattern);
+  init_pattern_buffer (&pattern->buf, &pattern->regs);
+  pattern->buf.fastmap = xcharalloc (UCHAR_MAX + 1);
+  *msg = re_compile_pattern (str, len, &pattern->buf);
+  if (*msg != NULL)
+    {
+      regfree (&pattern->buf);
+      free (pattern);
+      return NULL;
+    }
+  if (re_compile_fastmap (&pattern->buf))
+    assert (false);
+  pattern->str = xmemdup (str, len);
+  pattern->len = len;
+  pattern->syntax = re_syntax_options;
+  pattern->refs = 1;
+  pattern->literal = (len > 0 && pattern->syntax == RE_SYNTAX_EMACS
+                      && literal_pattern (str, len));
+  if (len > REGEX_CACHE_BYTES)
+    return pattern;
+
+  /* Make room by dropping the least recently used entries.  */
+  while (regex_cache_count == REGEX_CACHE_SIZE
+         || regex_cache_bytes + len > REGEX_CACHE_BYTES)
+    {
+      pattern_buffer *victim = regex_cache[--regex_cache_count];
+      regex_cache_bytes -= victim->len;
+      free_pattern (victim);
+    }
+  memmove (regex_cache + 1, regex_cache,
+           regex_cache_count * sizeof *regex_cache);
+  regex_cache[0] = pattern;
+  regex_cache_count++;
+  regex_cache_bytes += len;
+  pattern->refs++;
+  return pattern;
+}
+
+/*--------------------------------------------------------------.
+| Print the statistics of the regular expression cache, for the |
+| `s' debug flag.                                               |
+`--------------------------------------------------------------*/
+
+void
+show_regex_stats (void)
+{
+  DEBUG_MESSAGE2 ("regex cache: %lu hits, %lu misses",
+                  regex_cache_hits, regex_cache_misses);
+}
+
 /*-----------------------------------------------------------------.
 | Set the regular expression of --warn-macro-sequence that will be |
 | checked during define and pushdef.  Exit on failure.             |
@@ -249,78 +459,186 @@ void
 set_macro_sequence (const char *regexp)
 {
   const char *msg;
+  pattern_buffer *pattern;
 
   if (! regexp)
     regexp = DEFAULT_MACRO_SEQUENCE;
   else if (regexp[0] == '\0')
     {
-      macro_sequence_inuse = false;
+      if (macro_sequence)
+        free_pattern (macro_sequence);
+      macro_sequence = NULL;
       return;
     }
 
-  msg = re_compile_pattern (regexp, strlen (regexp), &macro_sequence_buf);
-  if (msg != NULL)
+  pattern = compile_pattern (regexp, strlen (regexp), &msg);
+  if (pattern == NULL)
     {
       M4ERROR ((EXIT_FAILURE, 0,
                 "--warn-macro-sequence: bad regular expression `%s': %s",
                 regexp, msg));
     }
-  re_set_registers (&macro_sequence_buf, &macro_sequence_regs,
-                    macro_sequence_regs.num_regs,
-                    macro_sequence_regs.start, macro_sequence_regs.end);
-  macro_sequence_inuse = true;
+  if (macro_sequence)
+    free_pattern (macro_sequence);
+  macro_sequence = pattern;
 }
 
 /*-----------------------------------------------------------.
 | Free dynamic memory utilized by the macro sequence regular |
-| expression during the define builtin.                      |
+| expression during the define builtin, and by the caches of |
+| regular expressions and of translit tables.                |
 `-----------------------------------------------------------*/
 void
 free_macro_sequence (void)
 {
-  free_pattern_buffer (&macro_sequence_buf, &macro_sequence_regs);
+  if (macro_sequence)
+    free_pattern (macro_sequence);
+  macro_sequence = NULL;
+  while (regex_cache_count > 0)
+    free_pattern (regex_cache[--regex_cache_count]);
+  regex_cache_bytes = 0;
+  while (translit_cache_count > 0)
+    {
+      translit_table *table = translit_cache[--translit_cache_count];
+      free (table->from);
+      free (table->to);
+      free (table);
+    }
+}
+
+/*-------------------------------------------------------------------.
+| Compile the definition TEXT of length LEN into the list of pieces  |
+| that expand_user_macro () walks.  Return NULL if TEXT contains no  |
+| parameter references, in which case the expansion is TEXT itself.  |
+`-------------------------------------------------------------------*/
+
+static macro_piece *
+compile_macro_body (const char *text, size_t len)
+{
+  const char *start = text;
+  const char *end = text + len;
+  const char *literal = text;
+  macro_piece *pieces = NULL;
+  size_t count = 0;
+  size_t alloc = 0;
+  int param;
+
+  while (1)
+    {
+      const char *dollar = (char *) memchr (text, '$', end - text);
+      if (!dollar)
+        {
+          if (pieces == NULL)
+            return NULL;
+          text = end;
+          param = PARAM_NONE;
+        }
+      else
+        {
+          text = dollar + 1;
+          if (text == end)
+            continue;
+          switch (*text)
+            {
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+              if (no_gnu_extensions)
+                param = *text++ - '0';
+              else
+                for (param = 0; text < end && isdigit (to_uchar (*text));
+                     text++)
+                  {
+                    /* An absurdly large argument number never exists,
+                       so saturate rather than overflow.  */
+                    if (param > (INT_MAX - 9) / 10)
+                      param = INT_MAX;
+                    else
+                      param = param * 10 + (*text - '0');
+                  }
+              break;
+
+            case '#':
+              param = PARAM_ARGC;
+              text++;
+              break;
+
+            case '*':
+              param = PARAM_STAR;
+              text++;
+              break;
+
+            case '@':
+              param = PARAM_AT;
+              text++;
+              break;
+
+            default:
+              /* A lone `$' is part of the literal text.  */
+              continue;
+            }
+        }
+
+      if (count == alloc)
+        pieces = x2nrealloc (pieces, &alloc, sizeof *pieces);
+      pieces[count].offset = literal - start;
+      pieces[count].len = (param == PARAM_NONE ? end : dollar) - literal;
+      pieces[count].param = param;
+      count++;
+      if (param == PARAM_NONE)
+        return pieces;
+      literal = text;
+    }
 }
 
 /*-----------------------------------------------------------------.
 | Define a predefined or user-defined macro, with name NAME, and   |
-| expansion TEXT.  MODE destinguishes between the "define" and the |
-| "pushdef" case.  It is also used from main.                      |
+| expansion TEXT of length LEN, which may contain NUL bytes.  MODE |
+| destinguishes between the "define" and the "pushdef" case.  It   |
+| is also used from main.                                          |
 `-----------------------------------------------------------------*/
 
 void
-define_user_macro (const char *name, const char *text, symbol_lookup mode)
+define_user_macro (const char *name, const char *text, size_t len,
+                   symbol_lookup mode)
 {
   symbol *s;
-  char *defn = xstrdup (text ? text : "");
+  char *defn = xcharalloc (len + 1);
+
+  if (len)
+    memcpy (defn, text, len);
+  defn[len] = '\0';
 
   s = lookup_symbol (name, mode);
   if (SYMBOL_TYPE (s) == TOKEN_TEXT)
     free (SYMBOL_TEXT (s));
+  free (SYMBOL_PIECES (s));
 
   SYMBOL_TYPE (s) = TOKEN_TEXT;
   SYMBOL_TEXT (s) = defn;
+  SYMBOL_TEXT_LEN (s) = len;
+  SYMBOL_PIECES (s) = compile_macro_body (defn, len);
 
   /* Implement --warn-macro-sequence.  */
-  if (macro_sequence_inuse && text)
+  if (macro_sequence && text)
     {
+      struct re_registers *regs = &macro_sequence->regs;
       regoff_t offset = 0;
-      size_t len = strlen (defn);
 
-      while ((offset = re_search (&macro_sequence_buf, defn, len, offset,
-                                  len - offset, &macro_sequence_regs)) >= 0)
+      while ((offset = re_search (&macro_sequence->buf, defn, len, offset,
+                                  len - offset, regs)) >= 0)
         {
           /* Skip empty matches.  */
-          if (macro_sequence_regs.start[0] == macro_sequence_regs.end[0])
+          if (regs->start[0] == regs->end[0])
             offset++;
           else
             {
               char tmp;
-              offset = macro_sequence_regs.end[0];
+              offset = regs->end[0];
               tmp = defn[offset];
               defn[offset] = '\0';
               M4ERROR ((warning_status, 0,
                         "Warning: definition of `%s' contains sequence `%s'",
-                        name, defn + macro_sequence_regs.start[0]));
+                        name, defn + regs->start[0]));
               defn[offset] = tmp;
             }
         }
@@ -361,12 +679,14 @@ builtin_init (void)
     if (no_gnu_extensions)
       {
         if (pp->unix_name != NULL)
-          define_user_macro (pp->unix_name, pp->func, SYMBOL_INSERT);
+          define_user_macro (pp->unix_name, pp->func, strlen (pp->func),
+                             SYMBOL_INSERT);
       }
     else
       {
         if (pp->gnu_name != NULL)
-          define_user_macro (pp->gnu_name, pp->func, SYMBOL_INSERT);
+          define_user_macro (pp->gnu_name, pp->func, strlen (pp->func),
+                             SYMBOL_INSERT);
       }
 }
 
@@ -400,17 +720,17 @@ bad_argc (token_data *name, int argc, int min, int max)
 }
 
 /*-----------------------------------------------------------------.
-| The function numeric_arg () converts ARG to an int pointed to by |
-| VALUEP.  If the conversion fails, print error message for macro  |
-| MACRO.  Return true iff conversion succeeds.                     |
+| The function numeric_arg () converts ARG of length LEN to an int |
+| pointed to by VALUEP.  If the conversion fails, print error      |
+| message for macro MACRO.  Return true iff conversion succeeds.   |
 `-----------------------------------------------------------------*/
 
 static bool
-numeric_arg (token_data *macro, const char *arg, int *valuep)
+numeric_arg (token_data *macro, const char *arg, size_t len, int *valuep)
 {
   char *endp;
 
-  if (*arg == '\0')
+  if (!len)
     {
       *valuep = 0;
       M4ERROR ((warning_status, 0,
@@ -421,7 +741,7 @@ numeric_arg (token_data *macro, const char *arg, int *valuep)
     {
       errno = 0;
       *valuep = strtol (arg, &endp, 10);
-      if (*endp != '\0')
+      if (endp != arg + len)
         {
           M4ERROR ((warning_status, 0,
                     "non-numeric argument to builtin `%s'",
@@ -513,8 +833,7 @@ dump_args (struct obstack *obs, int argc, token_data **argv,
         obstack_grow (obs, sep, len);
       if (quoted)
         obstack_grow (obs, lquote.string, lquote.length);
-      obstack_grow (obs, TOKEN_DATA_TEXT (argv[i]),
-                    strlen (TOKEN_DATA_TEXT (argv[i])));
+      obstack_grow (obs, TOKEN_DATA_TEXT (argv[i]), TOKEN_DATA_LEN (argv[i]));
       if (quoted)
         obstack_grow (obs, rquote.string, rquote.length);
     }
@@ -557,14 +876,14 @@ define_macro (int argc, token_data **argv, symbol_lookup mode)
 
   if (argc == 2)
     {
-      define_user_macro (ARG (1), "", mode);
+      define_user_macro (ARG (1), "", 0, mode);
       return;
     }
 
   switch (TOKEN_DATA_TYPE (argv[2]))
     {
     case TOKEN_TEXT:
-      define_user_macro (ARG (1), ARG (2), mode);
+      define_user_macro (ARG (1), ARG (2), ARG_LEN (2), mode);
       break;
 
     case TOKEN_FUNC:
@@ -623,27 +942,26 @@ static void
 m4_ifdef (struct obstack *obs, int argc, token_data **argv)
 {
   symbol *s;
-  const char *result;
+  int result;
 
   if (bad_argc (argv[0], argc, 3, 4))
     return;
   s = lookup_symbol (ARG (1), SYMBOL_LOOKUP);
 
   if (s != NULL && SYMBOL_TYPE (s) != TOKEN_VOID)
-    result = ARG (2);
+    result = 2;
   else if (argc >= 4)
-    result = ARG (3);
+    result = 3;
   else
-    result = NULL;
+    return;
 
-  if (result != NULL)
-    obstack_grow (obs, result, strlen (result));
+  append_arg_text (obs, argv[result]);
 }
 
 static void
 m4_ifelse (struct obstack *obs, int argc, token_data **argv)
 {
-  const char *result;
+  int result;
   token_data *me = argv[0];
 
   if (argc == 2)
@@ -658,11 +976,12 @@ m4_ifelse (struct obstack *obs, int argc, token_data **argv)
   argv++;
   argc--;
 
-  result = NULL;
-  while (result == NULL)
+  result = 0;
+  while (result == 0)
 
-    if (STREQ (ARG (0), ARG (1)))
-      result = ARG (2);
+    if (ARG_LEN (0) == ARG_LEN (1)
+        && memcmp (ARG (0), ARG (1), ARG_LEN (0)) == 0)
+      result = 2;
 
     else
       switch (argc)
@@ -672,7 +991,7 @@ m4_ifelse (struct obstack *obs, int argc, token_data **argv)
 
         case 4:
         case 5:
-          result = ARG (3);
+          result = 3;
           break;
 
         default:
@@ -680,7 +999,7 @@ m4_ifelse (struct obstack *obs, int argc, token_data **argv)
           argv += 3;
         }
 
-  obstack_grow (obs, result, strlen (result));
+  append_arg_text (obs, argv[result]);
 }
 
 /*-------------------------------------------------------------------.
@@ -832,6 +1151,10 @@ m4_builtin (struct obstack *obs, int argc, token_data **argv)
             {
               TOKEN_DATA_TYPE (argv[i]) = TOKEN_TEXT;
               TOKEN_DATA_TEXT (argv[i]) = (char *) "";
+              TOKEN_DATA_LEN (argv[i]) = 0;
+              TOKEN_DATA_SHARED (argv[i]) = NULL;
+              TOKEN_DATA_REFS (argv[i]) = NULL;
+              TOKEN_DATA_NREFS (argv[i]) = 0;
             }
       bp->func (obs, argc - 1, argv + 1);
     }
@@ -873,6 +1196,10 @@ m4_indir (struct obstack *obs, int argc, token_data **argv)
             {
               TOKEN_DATA_TYPE (argv[i]) = TOKEN_TEXT;
               TOKEN_DATA_TEXT (argv[i]) = (char *) "";
+              TOKEN_DATA_LEN (argv[i]) = 0;
+              TOKEN_DATA_SHARED (argv[i]) = NULL;
+              TOKEN_DATA_REFS (argv[i]) = NULL;
+              TOKEN_DATA_NREFS (argv[i]) = 0;
             }
       call_macro (s, argc - 1, argv + 1, obs);
     }
@@ -906,7 +1233,7 @@ m4_defn (struct obstack *obs, int argc, token_data **argv)
         {
         case TOKEN_TEXT:
           obstack_grow (obs, lquote.string, lquote.length);
-          obstack_grow (obs, SYMBOL_TEXT (s), strlen (SYMBOL_TEXT (s)));
+          obstack_grow (obs, SYMBOL_TEXT (s), SYMBOL_TEXT_LEN (s));
           obstack_grow (obs, rquote.string, rquote.length);
           break;
 
@@ -1085,7 +1412,7 @@ m4_eval (struct obstack *obs, int argc, token_data **argv)
   if (bad_argc (argv[0], argc, 2, 4))
     return;
 
-  if (*ARG (2) && !numeric_arg (argv[0], ARG (2), &radix))
+  if (ARG_LEN (2) && !numeric_arg (argv[0], ARG (2), ARG_LEN (2), &radix))
     return;
 
   if (radix < 1 || radix > (int) strlen (digits))
@@ -1096,7 +1423,7 @@ m4_eval (struct obstack *obs, int argc, token_data **argv)
       return;
     }
 
-  if (argc >= 4 && !numeric_arg (argv[0], ARG (3), &min))
+  if (argc >= 4 && !numeric_arg (argv[0], ARG (3), ARG_LEN (3), &min))
     return;
   if (min < 0)
     {
@@ -1105,10 +1432,10 @@ m4_eval (struct obstack *obs, int argc, token_data **argv)
       return;
     }
 
-  if (!*ARG (1))
+  if (!ARG_LEN (1))
     M4ERROR ((warning_status, 0,
               "empty string treated as 0 in builtin `%s'", ARG (0)));
-  else if (evaluate (ARG (1), &value))
+  else if (evaluate (ARG (1), ARG_LEN (1), &value))
     return;
 
   if (radix == 1)
@@ -1123,7 +1450,6 @@ m4_eval (struct obstack *obs, int argc, token_data **argv)
         obstack_1grow (obs, '0');
       while (value-- != 0)
         obstack_1grow (obs, '1');
-      obstack_1grow (obs, '\0');
       return;
     }
 
@@ -1148,7 +1474,7 @@ m4_incr (struct obstack *obs, int argc, token_data **argv)
   if (bad_argc (argv[0], argc, 2, 2))
     return;
 
-  if (!numeric_arg (argv[0], ARG (1), &value))
+  if (!numeric_arg (argv[0], ARG (1), ARG_LEN (1), &value))
     return;
 
   shipout_int (obs, value + 1);
@@ -1162,7 +1488,7 @@ m4_decr (struct obstack *obs, int argc, token_data **argv)
   if (bad_argc (argv[0], argc, 2, 2))
     return;
 
-  if (!numeric_arg (argv[0], ARG (1), &value))
+  if (!numeric_arg (argv[0], ARG (1), ARG_LEN (1), &value))
     return;
 
   shipout_int (obs, value - 1);
@@ -1184,7 +1510,7 @@ m4_divert (struct obstack *obs M4_GNUC_UNUSED, int argc, token_data **argv)
   if (bad_argc (argv[0], argc, 1, 2))
     return;
 
-  if (argc >= 2 && !numeric_arg (argv[0], ARG (1), &i))
+  if (argc >= 2 && !numeric_arg (argv[0], ARG (1), ARG_LEN (1), &i))
     return;
 
   make_diversion (i);
@@ -1265,6 +1591,8 @@ m4_dnl (struct obstack *obs M4_GNUC_UNUSED, int argc, token_data **argv)
 /*--------------------------------------------------------------------.
 | Shift all arguments one to the left, discarding the first           |
 | argument.  Each output argument is quoted with the current quotes.  |
+| Long argument lists are not copied, but referred to, so that loops  |
+| that recurse on shift($@) do not copy the whole list each time.     |
 `--------------------------------------------------------------------*/
 
 static void
@@ -1272,7 +1600,8 @@ m4_shift (struct obstack *obs, int argc, token_data **argv)
 {
   if (bad_argc (argv[0], argc, 2, -1))
     return;
-  dump_args (obs, argc - 1, argv + 1, ",", true);
+  if (!refer_to_args (obs, argc - 1, argv + 1, true))
+    dump_args (obs, argc - 1, argv + 1, ",", true);
 }
 
 /*--------------------------------------------------------------------------.
@@ -1455,12 +1784,12 @@ m4_maketemp (struct obstack *obs, int argc, token_data **argv)
       str = ntoa ((int32_t) getpid (), 10);
       len2 = strlen (str);
       if (len2 > len - i)
-        obstack_grow0 (obs, str + len2 - (len - i), len - i);
+        obstack_grow (obs, str + len2 - (len - i), len - i);
       else
         {
           while (i++ < len - len2)
             obstack_1grow (obs, '0');
-          obstack_grow0 (obs, str, len2);
+          obstack_grow (obs, str, len2);
         }
     }
   else
@@ -1485,9 +1814,9 @@ m4_errprint (struct obstack *obs, int argc, token_data **argv)
   if (bad_argc (argv[0], argc, 2, -1))
     return;
   dump_args (obs, argc, argv, " ", false);
-  obstack_1grow (obs, '\0');
   debug_flush_files ();
-  xfprintf (stderr, "%s", (char *) obstack_finish (obs));
+  fwrite (obstack_base (obs), 1, obstack_object_size (obs), stderr);
+  obstack_free (obs, obstack_finish (obs));
   fflush (stderr);
 }
 
@@ -1535,7 +1864,7 @@ m4_m4exit (struct obstack *obs M4_GNUC_UNUSED, int argc, token_data **argv)
 
   /* Warn on bad arguments, but still exit.  */
   bad_argc (argv[0], argc, 1, 2);
-  if (argc >= 2 && !numeric_arg (argv[0], ARG (1), &exit_code))
+  if (argc >= 2 && !numeric_arg (argv[0], ARG (1), ARG_LEN (1), &exit_code))
     exit_code = EXIT_FAILURE;
   if (exit_code < 0 || exit_code > 255)
     {
@@ -1567,11 +1896,11 @@ m4_m4wrap (struct obstack *obs, int argc, token_data **argv)
   if (bad_argc (argv[0], argc, 2, -1))
     return;
   if (no_gnu_extensions)
-    obstack_grow (obs, ARG (1), strlen (ARG (1)));
+    obstack_grow (obs, ARG (1), ARG_LEN (1));
   else
     dump_args (obs, argc, argv, " ", false);
-  obstack_1grow (obs, '\0');
-  push_wrapup ((char *) obstack_finish (obs));
+  push_wrapup ((char *) obstack_base (obs), obstack_object_size (obs));
+  obstack_free (obs, obstack_finish (obs));
 }
 
 /* Enable tracing of all specified macros, or all, if none is specified.
@@ -1721,7 +2050,106 @@ m4_len (struct obstack *obs, int argc, token_data **argv)
 {
   if (bad_argc (argv[0], argc, 2, 2))
     return;
-  shipout_int (obs, strlen (ARG (1)));
+  shipout_int (obs, ARG_LEN (1));
+}
+
+#if FILTER_SUBSTRING
+
+/* Look for NEEDLE, of length NEEDLE_LEN, in the *HAYSTACK_LEN bytes at
+   *HAYSTACK, 16 positions at a time: only the positions where both the
+   first and the last byte of NEEDLE match are compared in full.
+   Return the match, or NULL after advancing *HAYSTACK past the
+   positions ruled out, which stops short of the end when fewer than
+   16 positions remain, or when full comparisons take more time than
+   the filter saves, as they would for a needle of repeated bytes.
+   NEEDLE_LEN is at least 2.  */
+static const char *
+filter_substring (const char **haystack, size_t *haystack_len,
+                  const char *needle, size_t needle_len)
+{
+  const char *text = *haystack;
+  const __m128i first = _mm_set1_epi8 (needle[0]);
+  const __m128i last = _mm_set1_epi8 (needle[needle_len - 1]);
+  size_t compared = 0;
+  size_t i = 0;
+
+  for (; i + 15 + needle_len <= *haystack_len; i += 16)
+    {
+      __m128i head = _mm_loadu_si128 ((const __m128i *) (text + i));
+      __m128i tail = _mm_loadu_si128 ((const __m128i *)
+                                      (text + i + needle_len - 1));
+      unsigned int mask
+        = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (head, first),
+                                            _mm_cmpeq_epi8 (tail, last)));
+      while (mask)
+        {
+          const char *candidate = text + i + __builtin_ctz (mask);
+          if (memcmp (candidate + 1, needle + 1, needle_len - 2) == 0)
+            return candidate;
+          compared += needle_len;
+          if (compared > i + 1024)
+            {
+              *haystack = text + i;
+              *haystack_len -= i;
+              return NULL;
+            }
+          mask &= mask - 1;
+        }
+    }
+  *haystack = text + i;
+  *haystack_len -= i;
+  return NULL;
+}
+
+#endif /* FILTER_SUBSTRING */
+
+/*------------------------------------------------------------------.
+| Return the first occurrence of NEEDLE, of length NEEDLE_LEN, in   |
+| HAYSTACK, of length HAYSTACK_LEN, or NULL if there is none.  Both |
+| strings may contain NUL bytes.                                    |
+`------------------------------------------------------------------*/
+
+static const char *
+find_substring (const char *haystack, size_t haystack_len,
+                const char *needle, size_t needle_len)
+{
+  const char *start;
+
+  if (needle_len == 0)
+    return haystack;
+  if (haystack_len < needle_len)
+    return NULL;
+
+  /* Reduce the size of haystack using memchr, since it has a smaller
+     linear coefficient than the two-way algorithm.  */
+  start = haystack;
+  haystack = (char *) memchr (haystack, *needle, haystack_len);
+  if (haystack == NULL || needle_len == 1)
+    return haystack;
+  haystack_len -= haystack - start;
+  if (haystack_len < needle_len)
+    return NULL;
+
+#if FILTER_SUBSTRING
+  /* The two-way algorithm finishes whatever the filter left, and keeps
+     the search linear.  */
+  {
+    const char *match = filter_substring (&haystack, &haystack_len,
+                                          needle, needle_len);
+    if (match || haystack_len < needle_len)
+      return match;
+  }
+#endif
+
+  if (needle_len < LONG_NEEDLE_THRESHOLD)
+    return (char *) two_way_short_needle ((const unsigned char *) haystack,
+                                          haystack_len,
+                                          (const unsigned char *) needle,
+                                          needle_len);
+  return (char *) two_way_long_needle ((const unsigned char *) haystack,
+                                       haystack_len,
+                                       (const unsigned char *) needle,
+                                       needle_len);
 }
 
 /*-------------------------------------------------------------------.
@@ -1745,7 +2173,7 @@ m4_index (struct obstack *obs, int argc, token_data **argv)
     }
 
   haystack = ARG (1);
-  result = strstr (haystack, ARG (2));
+  result = find_substring (haystack, ARG_LEN (1), ARG (2), ARG_LEN (2));
   retval = result ? result - haystack : -1;
 
   shipout_int (obs, retval);
@@ -1769,15 +2197,15 @@ m4_substr (struct obstack *obs, int argc, token_data **argv)
     {
       /* builtin(`substr') is blank, but substr(`abc') is abc.  */
       if (argc == 2)
-        obstack_grow (obs, ARG (1), strlen (ARG (1)));
+        obstack_grow (obs, ARG (1), ARG_LEN (1));
       return;
     }
 
-  length = avail = strlen (ARG (1));
-  if (!numeric_arg (argv[0], ARG (2), &start))
+  length = avail = ARG_LEN (1);
+  if (!numeric_arg (argv[0], ARG (2), ARG_LEN (2), &start))
     return;
 
-  if (argc >= 4 && !numeric_arg (argv[0], ARG (3), &length))
+  if (argc >= 4 && !numeric_arg (argv[0], ARG (3), ARG_LEN (3), &length))
     return;
 
   if (start < 0 || length <= 0 || start >= avail)
@@ -1796,44 +2224,134 @@ m4_substr (struct obstack *obs, int argc, token_data **argv)
 | included in the strings by being the first or the last character  |
 | in the string.  If the first character in a range is after the    |
 | first in the character set, the range is made backwards, thus 9-0 |
-| is the string 9876543210.                                         |
+| is the string 9876543210.  S is *LEN bytes long, and *LEN is set  |
+| to the length of the expansion.                                   |
 `------------------------------------------------------------------*/
 
 static const char *
-expand_ranges (const char *s, struct obstack *obs)
+expand_ranges (const char *s, size_t *len, struct obstack *obs)
 {
-  unsigned char from;
+  const char *end = s + *len;
+  bool have_from = false;
+  unsigned char from = '\0';
   unsigned char to;
 
-  for (from = '\0'; *s != '\0'; from = to_uchar (*s++))
+  while (s < end)
     {
-      if (*s == '-' && from != '\0')
+      if (*s == '-' && have_from)
         {
-          to = to_uchar (*++s);
-          if (to == '\0')
+          if (++s == end)
             {
               /* trailing dash */
               obstack_1grow (obs, '-');
               break;
             }
-          else if (from <= to)
-            {
-              while (from++ < to)
-                obstack_1grow (obs, from);
-            }
-          else
-            {
-              while (--from >= to)
-                obstack_1grow (obs, from);
-            }
+          to = to_uchar (*s);
+          while (from < to)
+            obstack_1grow (obs, ++from);
+          while (from > to)
+            obstack_1grow (obs, --from);
         }
       else
         obstack_1grow (obs, *s);
+      from = to_uchar (*s++);
+      have_from = true;
     }
+  *len = obstack_object_size (obs);
   obstack_1grow (obs, '\0');
   return (char *) obstack_finish (obs);
 }
 
+/*-------------------------------------------------------------------.
+| Return the translation table of translit for FROM and TO, of      |
+| FROM_LEN and TO_LEN bytes, building it if it is not in the cache.  |
+| Ranges are expanded on OBS.                                        |
+`-------------------------------------------------------------------*/
+
+static const translit_table *
+translit_table_for (const char *from, size_t from_len,
+                    const char *to, size_t to_len, struct obstack *obs)
+{
+  translit_table *table;
+  char found[UCHAR_MAX + 1];
+  unsigned char ch;
+  size_t j;
+  int i;
+
+  for (i = 0; i < translit_cache_count; i++)
+    {
+      table = translit_cache[i];
+      if (table->from_len == from_len && table->to_len == to_len
+          && memcmp (table->from, from, from_len) == 0
+          && memcmp (table->to, to, to_len) == 0)
+        {
+          memmove (translit_cache + 1, translit_cache,
+                   i * sizeof *translit_cache);
+          translit_cache[0] = table;
+          return table;
+        }
+    }
+
+  if (translit_cache_count < TRANSLIT_CACHE_SIZE)
+    table = (translit_table *) xmalloc (sizeof *table);
+  else
+    {
+      /* Reuse the least recently used table.  */
+      table = translit_cache[--translit_cache_count];
+      free (table->from);
+      free (table->to);
+    }
+  memmove (translit_cache + 1, translit_cache,
+           translit_cache_count * sizeof *translit_cache);
+  translit_cache[0] = table;
+  translit_cache_count++;
+  table->from = xmemdup (from, from_len);
+  table->from_len = from_len;
+  table->to = xmemdup (to, to_len);
+  table->to_len = to_len;
+
+  if (memchr (to, '-', to_len) != NULL)
+    {
+      to = expand_ranges (to, &to_len, obs);
+      assert (to_len);
+    }
+  if (memchr (from, '-', from_len) != NULL)
+    {
+      from = expand_ranges (from, &from_len, obs);
+      assert (from_len);
+    }
+
+  /* Calling strchr(from) for each character in data is quadratic,
+     since both strings can be arbitrarily long.  Instead, create a
+     from-to mapping in one pass of from, then use that map in one
+     pass of data, for linear behavior.  Traditional behavior is that
+     only the first instance of a character in from is consulted,
+     hence the found map.  */
+  for (i = 0; i <= UCHAR_MAX; i++)
+    {
+      table->map[i] = i;
+      table->keep[i] = 1;
+    }
+  memset (found, 0, sizeof found);
+  table->deletes_only = true;
+  for (j = 0; j < from_len; j++)
+    {
+      ch = from[j];
+      if (! found[ch])
+        {
+          found[ch] = 1;
+          if (j >= to_len)
+            table->keep[ch] = 0;
+          else if (to_uchar (to[j]) != ch)
+            {
+              table->map[ch] = to[j];
+              table->deletes_only = false;
+            }
+        }
+    }
+  return table;
+}
+
 /*-----------------------------------------------------------------.
 | The macro "translit" translates all characters in the first      |
 | argument, which are present in the second argument, into the     |
@@ -1846,35 +2364,35 @@ static void
 m4_translit (struct obstack *obs, int argc, token_data **argv)
 {
   const char *data = ARG (1);
+  size_t len = ARG_LEN (1);
   const char *from = ARG (2);
-  const char *to;
-  char map[UCHAR_MAX + 1];
-  char found[UCHAR_MAX + 1];
-  unsigned char ch;
+  size_t from_len = ARG_LEN (2);
+  const char *to = ARG (3);
+  size_t to_len = ARG_LEN (3);
+  const translit_table *table;
 
-  if (bad_argc (argv[0], argc, 3, 4) || !*data || !*from)
+  if (bad_argc (argv[0], argc, 3, 4) || !len || !from_len)
     {
       /* builtin(`translit') is blank, but translit(`abc') is abc.  */
       if (2 <= argc)
-        obstack_grow (obs, data, strlen (data));
+        obstack_grow (obs, data, len);
       return;
     }
 
-  to = ARG (3);
-  if (strchr (to, '-') != NULL)
-    {
-      to = expand_ranges (to, obs);
-      assert (to && *to);
-    }
-
   /* If there are only one or two bytes to replace, it is faster to
      use memchr2.  Using expand_ranges does nothing unless there are
      at least three bytes.  */
-  if (!from[1] || !from[2])
+  if (from_len <= 2)
     {
       const char *p;
-      size_t len = strlen (data);
-      while ((p = (char *) memchr2 (data, from[0], from[1], len)))
+      if (memchr (to, '-', to_len) != NULL)
+        {
+          to = expand_ranges (to, &to_len, obs);
+          assert (to_len);
+        }
+      /* A single byte FROM is searched for twice.  */
+      while ((p = (char *) memchr2 (data, from[0],
+                                    from[from_len - 1], len)))
         {
           obstack_grow (obs, data, p - data);
           len -= p - data;
@@ -1882,46 +2400,51 @@ m4_translit (struct obstack *obs, int argc, token_data **argv)
             return;
           data = p + 1;
           len--;
-          if (*p == from[0] && to[0])
-            obstack_1grow (obs, to[0]);
-          else if (*p == from[1] && to[0] && to[1])
+          if (*p == from[0])
+            {
+              if (0 < to_len)
+                obstack_1grow (obs, to[0]);
+            }
+          else if (1 < to_len)
             obstack_1grow (obs, to[1]);
         }
       obstack_grow (obs, data, len);
       return;
     }
 
-  if (strchr (from, '-') != NULL)
-    {
-      from = expand_ranges (from, obs);
-      assert (from && *from);
-    }
-
-  /* Calling strchr(from) for each character in data is quadratic,
-     since both strings can be arbitrarily long.  Instead, create a
-     from-to mapping in one pass of from, then use that map in one
-     pass of data, for linear behavior.  Traditional behavior is that
-     only the first instance of a character in from is consulted,
-     hence the found map.  */
-  memset (map, 0, sizeof map);
-  memset (found, 0, sizeof found);
-  for ( ; (ch = *from) != '\0'; from++)
+  table = translit_table_for (from, from_len, to, to_len, obs);
+  if (table->deletes_only)
     {
-      if (! found[ch])
+      /* Copy the runs of bytes between those deleted.  */
+      const char *end = data + len;
+      const char *p;
+      while (1)
         {
-          found[ch] = 1;
-          map[ch] = *to;
+          for (p = data; p < end && table->keep[to_uchar (*p)]; p++)
+            ;
+          obstack_grow (obs, data, p - data);
+          if (p == end)
+            break;
+          data = p + 1;
         }
-      if (*to != '\0')
-        to++;
     }
-
-  for (data = ARG (1); (ch = *data) != '\0'; data++)
+  else
     {
-      if (! found[ch])
-        obstack_1grow (obs, ch);
-      else if (map[ch])
-        obstack_1grow (obs, map[ch]);
+      /* Translate into room for every byte, then give back the room of
+         the bytes deleted.  */
+      char *out;
+      size_t used = 0;
+      size_t i;
+
+      obstack_blank (obs, len);
+      out = (char *) obstack_next_free (obs) - len;
+      for (i = 0; i < len; i++)
+        {
+          unsigned char ch = data[i];
+          out[used] = table->map[ch];
+          used += table->keep[ch];
+        }
+      obstack_blank (obs, -(int) (len - used));
     }
 }
 
@@ -1944,28 +2467,30 @@ m4_format (struct obstack *obs, int argc, token_data **argv)
 | the obstack.  The substitution is REPL, with \& substituted by    |
 | this part of VICTIM matched by the last whole regular expression, |
 | taken from REGS[0], and \N substituted by the text matched by the |
-| Nth parenthesized sub-expression, taken from REGS[N].             |
+| Nth parenthesized sub-expression, taken from REGS[N].  REPL is    |
+| REPL_LEN bytes long.                                              |
 `------------------------------------------------------------------*/
 
 static int substitute_warned = 0;
 
 static void
 substitute (struct obstack *obs, const char *victim, const char *repl,
-            struct re_registers *regs)
+            size_t repl_len, struct re_registers *regs)
 {
+  const char *repl_end = repl + repl_len;
   int ch;
   __re_size_t ind;
   while (1)
     {
-      const char *backslash = strchr (repl, '\\');
+      const char *backslash = (char *) memchr (repl, '\\', repl_end - repl);
       if (!backslash)
         {
-          obstack_grow (obs, repl, strlen (repl));
+          obstack_grow (obs, repl, repl_end - repl);
           return;
         }
       obstack_grow (obs, repl, backslash - repl);
       repl = backslash;
-      ch = *++repl;
+      ch = ++repl < repl_end ? to_uchar (*repl) : EOF;
       switch (ch)
         {
         case '0':
@@ -1995,7 +2520,7 @@ Warning: \\0 will disappear, use \\& instead in replacements"));
           repl++;
           break;
 
-        case '\0':
+        case EOF:
           M4ERROR ((warning_status, 0,
                     "Warning: trailing \\ ignored in replacement"));
           return;
@@ -2008,6 +2533,29 @@ Warning: \\0 will disappear, use \\& instead in replacements"));
     }
 }
 
+/*-----------------------------------------------------------------.
+| Return true if the replacement REPL, of REPL_LEN bytes, refers to |
+| a parenthesized sub-expression with \N, so that substitute needs  |
+| more than the extent of the whole match.                         |
+`-----------------------------------------------------------------*/
+
+static bool
+substitute_uses_groups (const char *repl, size_t repl_len)
+{
+  const char *repl_end = repl + repl_len;
+  const char *backslash;
+
+  while ((backslash = (char *) memchr (repl, '\\', repl_end - repl)))
+    {
+      if (backslash + 1 == repl_end)
+        break;
+      if ('1' <= backslash[1] && backslash[1] <= '9')
+        return true;
+      repl = backslash + 2;
+    }
+  return false;
+}
+
 /*------------------------------------------.
 | Initialize regular expression variables.  |
 `------------------------------------------*/
@@ -2026,6 +2574,50 @@ init_pattern_buffer (struct re_pattern_buffer *buf, struct re_registers *regs)
     }
 }
 
+/*-------------------------------------------------------------------.
+| Search for PATTERN in the LENGTH bytes of VICTIM, starting at      |
+| OFFSET, like re_search with a range reaching the end of VICTIM.    |
+| Return the position of the match, -1 if there is none, or -2 on an |
+| internal error.  Fill REGS with the extent of the match unless it  |
+| is NULL.  A literal pattern is found without the regex matcher.    |
+`-------------------------------------------------------------------*/
+
+static regoff_t
+search_pattern (pattern_buffer *pattern, const char *victim, regoff_t length,
+                regoff_t offset, struct re_registers *regs)
+{
+  const char *match;
+  __re_size_t i;
+
+  if (!pattern->literal)
+    return re_search (&pattern->buf, victim, length, offset,
+                      length - offset, regs);
+
+  match = find_substring (victim + offset, length - offset,
+                          pattern->str, pattern->len);
+  if (match == NULL)
+    return -1;
+  if (regs)
+    {
+      /* Lay out REGS the way re_search would, for a pattern without
+         sub-expressions, so that the two can share it.  */
+      if (pattern->buf.regs_allocated == REGS_UNALLOCATED)
+        {
+          regs->num_regs = 2;
+          regs->start = (regoff_t *) xnmalloc (regs->num_regs,
+                                               sizeof *regs->start);
+          regs->end = (regoff_t *) xnmalloc (regs->num_regs,
+                                             sizeof *regs->end);
+          pattern->buf.regs_allocated = REGS_REALLOCATE;
+        }
+      regs->start[0] = match - victim;
+      regs->end[0] = regs->start[0] + pattern->len;
+      for (i = 1; i < regs->num_regs; i++)
+        regs->start[i] = regs->end[i] = -1;
+    }
+  return match - victim;
+}
+
 /*------------------------------------------------------------------.
 | Regular expression version of index.  Given two arguments, expand |
 | to the index of the first match of the second argument (a regexp) |
@@ -2040,8 +2632,7 @@ m4_regexp (struct obstack *obs, int argc, token_data **argv)
   const char *regexp;           /* regular expression */
   const char *repl;             /* replacement string */
 
-  struct re_pattern_buffer buf; /* compiled regular expression */
-  struct re_registers regs;     /* for subexpression matches */
+  pattern_buffer *pattern;      /* compiled regular expression */
   const char *msg;              /* error message from re_compile_pattern */
   int startpos;                 /* start position of match */
   int length;                   /* length of first argument */
@@ -2057,21 +2648,19 @@ m4_regexp (struct obstack *obs, int argc, token_data **argv)
   victim = TOKEN_DATA_TEXT (argv[1]);
   regexp = TOKEN_DATA_TEXT (argv[2]);
 
-  init_pattern_buffer (&buf, &regs);
-  msg = re_compile_pattern (regexp, strlen (regexp), &buf);
+  pattern = compile_pattern (regexp, ARG_LEN (2), &msg);
 
-  if (msg != NULL)
+  if (pattern == NULL)
     {
       M4ERROR ((warning_status, 0,
                 "bad regular expression: `%s': %s", regexp, msg));
-      free_pattern_buffer (&buf, &regs);
       return;
     }
 
-  length = strlen (victim);
+  length = ARG_LEN (1);
   /* Avoid overhead of allocating regs if we won't use it.  */
-  startpos = re_search (&buf, victim, length, 0, length,
-                        argc == 3 ? NULL : &regs);
+  startpos = search_pattern (pattern, victim, length, 0,
+                             argc == 3 ? NULL : &pattern->regs);
 
   if (startpos == -2)
     M4ERROR ((warning_status, 0,
@@ -2081,10 +2670,10 @@ m4_regexp (struct obstack *obs, int argc, token_data **argv)
   else if (startpos >= 0)
     {
       repl = TOKEN_DATA_TEXT (argv[3]);
-      substitute (obs, victim, repl, &regs);
+      substitute (obs, victim, repl, ARG_LEN (3), &pattern->regs);
     }
 
-  free_pattern_buffer (&buf, &regs);
+  free_pattern (pattern);
 }
 
 /*--------------------------------------------------------------------------.
@@ -2100,42 +2689,66 @@ m4_patsubst (struct obstack *obs, int argc, token_data **argv)
   const char *victim;           /* first argument */
   const char *regexp;           /* regular expression */
 
-  struct re_pattern_buffer buf; /* compiled regular expression */
-  struct re_registers regs;     /* for subexpression matches */
+  pattern_buffer *pattern;      /* compiled regular expression */
+  struct re_registers *regs;    /* for subexpression matches */
+  struct re_registers whole;    /* for the whole match only */
+  regoff_t whole_start;         /* storage for whole */
+  regoff_t whole_end;           /* storage for whole */
+  unsigned regs_allocated;      /* saved allocation state of the
+                                   pattern's own registers */
   const char *msg;              /* error message from re_compile_pattern */
   int matchpos;                 /* start position of match */
   int offset;                   /* current match offset */
+  int copied;                   /* end of text already copied */
   int length;                   /* length of first argument */
 
   if (bad_argc (argv[0], argc, 3, 4))
     {
       /* builtin(`patsubst') is blank, but patsubst(`abc') is abc.  */
       if (argc == 2)
-        obstack_grow (obs, ARG (1), strlen (ARG (1)));
+        obstack_grow (obs, ARG (1), ARG_LEN (1));
       return;
     }
 
   regexp = TOKEN_DATA_TEXT (argv[2]);
 
-  init_pattern_buffer (&buf, &regs);
-  msg = re_compile_pattern (regexp, strlen (regexp), &buf);
+  pattern = compile_pattern (regexp, ARG_LEN (2), &msg);
 
-  if (msg != NULL)
+  if (pattern == NULL)
     {
       M4ERROR ((warning_status, 0,
                 "bad regular expression `%s': %s", regexp, msg));
-      free (buf.buffer);
       return;
     }
 
+  regs = &pattern->regs;
   victim = TOKEN_DATA_TEXT (argv[1]);
-  length = strlen (victim);
+  length = ARG_LEN (1);
 
-  offset = 0;
+  /* Locating the sub-expressions of a match is much slower than
+     locating the match itself, so unless the replacement refers to
+     them, only ask for the extent of the whole match.  */
+
+  regs_allocated = pattern->buf.regs_allocated;
+  if (pattern->buf.re_nsub > 0
+      && !substitute_uses_groups (ARG (3), ARG_LEN (3)))
+    {
+      whole.num_regs = 1;
+      whole.start = &whole_start;
+      whole.end = &whole_end;
+      regs = &whole;
+      pattern->buf.regs_allocated = REGS_FIXED;
+    }
+
+  /* The result is usually about as long as the first argument, so
+     make room for it at once rather than growing it piecemeal.  */
+
+  obstack_make_room (obs, length);
+
+  offset = copied = 0;
   while (offset <= length)
     {
-      matchpos = re_search (&buf, victim, length,
-                            offset, length - offset, &regs);
+      matchpos = search_pattern (pattern, victim, length, offset, regs);
       if (matchpos < 0)
         {
 
@@ -2146,31 +2759,36 @@ m4_patsubst (struct obstack *obs, int argc, token_data **argv)
           if (matchpos == -2)
             M4ERROR ((warning_status, 0,
                       "error matching regular expression `%s'", regexp));
-          else if (offset < length)
-            obstack_grow (obs, victim + offset, length - offset);
+          else if (copied < length)
+            obstack_grow (obs, victim + copied, length - copied);
           break;
         }
 
-      /* Copy the part of the string that was skipped by re_search ().  */
+      /* Copy the part of the string that was skipped by re_search (),
+         including any bytes stepped over after null matches.  */
 
-      if (matchpos > offset)
-        obstack_grow (obs, victim + offset, matchpos - offset);
+      if (matchpos > copied)
+        obstack_grow (obs, victim + copied, matchpos - copied);
 
       /* Handle the part of the string that was covered by the match.  */
 
-      substitute (obs, victim, ARG (3), &regs);
+      substitute (obs, victim, ARG (3), ARG_LEN (3), regs);
 
       /* Update the offset to the end of the match.  If the regexp
          matched a null string, advance offset one more, to avoid
-         infinite loops.  */
+         infinite loops; the byte stepped over is copied along with
+         the text before the next match.  */
 
-      offset = regs.end[0];
-      if (regs.start[0] == regs.end[0])
-        obstack_1grow (obs, victim[offset++]);
+      offset = copied = regs->end[0];
+      if (regs->start[0] == regs->end[0])
+        offset++;
     }
-  obstack_1grow (obs, '\0');
 
-  free_pattern_buffer (&buf, &regs);
+  /* Only undo REGS_FIXED; the state of the pattern's own registers
+     must stay as re_search left it, or they would leak.  */
+  if (regs == &whole)
+    pattern->buf.regs_allocated = regs_allocated;
+  free_pattern (pattern);
 }
 
 /* Finally, a placeholder builtin.  This builtin is not installed by
@@ -2200,8 +2818,9 @@ builtin `%s' requested by frozen file is not supported", ARG (0)));
 | This function handles all expansion of user defined and predefined |
 | macros.  It is called with an obstack OBS, where the macros        |
 | expansion will be placed, as an unfinished object.  SYM points to  |
-| the macro definition, giving the expansion text.  ARGC and ARGV    |
-| are the arguments, as usual.                                       |
+| the macro definition, giving the expansion text and the pieces it  |
+| was compiled into by define_user_macro ().  ARGC and ARGV are the  |
+| arguments, as usual.                                               |
 `-------------------------------------------------------------------*/
 
 void
@@ -2209,48 +2828,34 @@ expand_user_macro (struct obstack *obs, symbol *sym,
                    int argc, token_data **argv)
 {
   const char *text = SYMBOL_TEXT (sym);
-  int i;
-  while (1)
+  const macro_piece *piece = SYMBOL_PIECES (sym);
+
+  if (piece == NULL)
     {
-      const char *dollar = strchr (text, '$');
-      if (!dollar)
+      obstack_grow (obs, text, SYMBOL_TEXT_LEN (sym));
+      return;
+    }
+  for (;; piece++)
+    {
+      obstack_grow (obs, text + piece->offset, piece->len);
+      switch (piece->param)
         {
-          obstack_grow (obs, text, strlen (text));
+        case PARAM_NONE:
           return;
-        }
-      obstack_grow (obs, text, dollar - text);
-      text = dollar;
-      switch (*++text)
-        {
-        case '0': case '1': case '2': case '3': case '4':
-        case '5': case '6': case '7': case '8': case '9':
-          if (no_gnu_extensions)
-            {
-              i = *text++ - '0';
-            }
-          else
-            {
-              for (i = 0; isdigit (to_uchar (*text)); text++)
-                i = i*10 + (*text - '0');
-            }
-          if (i < argc)
-            obstack_grow (obs, TOKEN_DATA_TEXT (argv[i]),
-                          strlen (TOKEN_DATA_TEXT (argv[i])));
-          break;
 
-        case '#': /* number of arguments */
+        case PARAM_ARGC:
           shipout_int (obs, argc - 1);
-          text++;
           break;
 
-        case '*': /* all arguments */
-        case '@': /* ... same, but quoted */
-          dump_args (obs, argc, argv, ",", *text == '@');
-          text++;
+        case PARAM_STAR:
+        case PARAM_AT:
+          if (!refer_to_args (obs, argc, argv, piece->param == PARAM_AT))
+            dump_args (obs, argc, argv, ",", piece->param == PARAM_AT);
           break;
 
         default:
-          obstack_1grow (obs, '$');
+          if (piece->param < argc)
+            append_arg_text (obs, argv[piece->param]);
           break;
         }
     }
@@ -103,6 +103,10 @@ debug_decode (const char *opts)
               level |= DEBUG_TRACE_CALLID;
               break;
 
+            case 's':
+              level |= DEBUG_TRACE_STATS;
+              break;
+
             case 'V':
               level |= DEBUG_TRACE_VERBOSE;
               break;
@@ -171,6 +175,7 @@ debug_set_file (FILE *fp)
 void
 debug_flush_files (void)
 {
+  output_flush ();
   fflush (stdout);
   fflush (stderr);
   if (debug != NULL && debug != stdout && debug != stderr)
@@ -187,7 +192,10 @@ debug_flush_files (void)
      operating with stdin closed, so we don't report any failures in
      this attempt.  The stdio-safer module and friends are essential,
      so that if stdin was closed, this lseek is not on some other file
-     that we have since opened.  */
+     that we have since opened.  Input files are read ahead into
+     private buffers, so first give back whatever was read from stdin
+     but not yet consumed.  */
+  sync_input_files ();
   if (lseek (STDIN_FILENO, 0, SEEK_CUR) >= 0
       && fflush (stdin) == 0)
     {
@@ -232,6 +240,8 @@ debug_set_output (const char *name)
 void
 debug_message_prefix (void)
 {
+  if (debug == stdout)
+    output_flush ();
   xfprintf (debug, "m4debug:");
   if (current_line)
   {
@@ -349,6 +359,8 @@ trace_flush (void)
 
   obstack_1grow (&trace, '\0');
   line = (char *) obstack_finish (&trace);
+  if (debug == stdout)
+    output_flush ();
   DEBUG_PRINT1 ("%s\n", line);
   obstack_free (&trace, line);
 }
@@ -287,7 +287,7 @@ eval_lex (int32_t *val)
 `---------------------------------------*/
 
 bool
-evaluate (const char *expr, int32_t *val)
+evaluate (const char *expr, size_t len, int32_t *val)
 {
   eval_token et;
   eval_error err;
@@ -296,9 +296,11 @@ evaluate (const char *expr, int32_t *val)
   et = eval_lex (val);
   err = logical_or_term (et, val);
 
-  if (err == NO_ERROR && *eval_text != '\0')
+  /* A NUL byte ends the scan early, so compare with LEN to catch
+     what follows it too.  */
+  if (err == NO_ERROR && eval_text != expr + len)
     {
-      if (eval_lex (val) == BADOP)
+      if (*eval_text != '\0' && eval_lex (val) == BADOP)
         err = INVALID_OPERATOR;
       else
         err = EXCESS_INPUT;
@@ -26,13 +26,12 @@
 /* Simple varargs substitute.  We assume int and unsigned int are the
    same size; likewise for long and unsigned long.  */
 
-/* Parse STR as an integer, reporting warnings.  */
+/* Parse STR of length LEN as an integer, reporting warnings.  */
 static int
-arg_int (const char *str)
+arg_int (const char *str, size_t len)
 {
   char *endp;
   long value;
-  size_t len = strlen (str);
 
   if (!len)
     {
@@ -50,13 +49,12 @@ arg_int (const char *str)
   return value;
 }
 
-/* Parse STR as a long, reporting warnings.  */
+/* Parse STR of length LEN as a long, reporting warnings.  */
 static long
-arg_long (const char *str)
+arg_long (const char *str, size_t len)
 {
   char *endp;
   long value;
-  size_t len = strlen (str);
 
   if (!len)
     {
@@ -74,13 +72,12 @@ arg_long (const char *str)
   return value;
 }
 
-/* Parse STR as a double, reporting warnings.  */
+/* Parse STR of length LEN as a double, reporting warnings.  */
 static double
-arg_double (const char *str)
+arg_double (const char *str, size_t len)
 {
   char *endp;
   double value;
-  size_t len = strlen (str);
 
   if (!len)
     {
@@ -100,19 +97,26 @@ arg_double (const char *str)
 
 #define ARG_INT(argc, argv) \
         ((argc == 0) ? 0 : \
-         (--argc, argv++, arg_int (TOKEN_DATA_TEXT (argv[-1]))))
+         (--argc, argv++, arg_int (TOKEN_DATA_TEXT (argv[-1]), \
+                                   TOKEN_DATA_LEN (argv[-1]))))
 
 #define ARG_LONG(argc, argv) \
         ((argc == 0) ? 0 : \
-         (--argc, argv++, arg_long (TOKEN_DATA_TEXT (argv[-1]))))
+         (--argc, argv++, arg_long (TOKEN_DATA_TEXT (argv[-1]), \
+                                    TOKEN_DATA_LEN (argv[-1]))))
 
 #define ARG_STR(argc, argv) \
         ((argc == 0) ? "" : \
          (--argc, argv++, TOKEN_DATA_TEXT (argv[-1])))
 
+/* The length of the argument that ARG_STR would consume next.  */
+#define ARG_LEN(argc, argv) \
+        ((argc == 0) ? 0 : TOKEN_DATA_LEN (argv[0]))
+
 #define ARG_DOUBLE(argc, argv) \
         ((argc == 0) ? 0 : \
-         (--argc, argv++, arg_double (TOKEN_DATA_TEXT (argv[-1]))))
+         (--argc, argv++, arg_double (TOKEN_DATA_TEXT (argv[-1]), \
+                                      TOKEN_DATA_LEN (argv[-1]))))
 
 
 /*------------------------------------------------------------------.
@@ -128,6 +132,7 @@ expand_format (struct obstack *obs, int argc, token_data **argv)
 {
   const char *f;                        /* format control string */
   const char *fmt;                      /* position within f */
+  const char *f_end;                    /* end of f */
   char fstart[] = "%'+- 0#*.*hhd";      /* current format spec */
   char *p;                              /* position within fstart */
   unsigned char c;                      /* a simple character */
@@ -156,16 +161,20 @@ expand_format (struct obstack *obs, int argc, token_data **argv)
 
   /* Buffer and stuff.  */
   char *str;                    /* malloc'd buffer of formatted text */
+  const char *arg;              /* %s argument */
+  size_t len;                   /* length of arg, or of f */
   enum {CHAR, INT, LONG, DOUBLE, STR} datatype;
 
+  len = ARG_LEN (argc, argv);
   f = fmt = ARG_STR (argc, argv);
+  f_end = f + len;
   memset (ok, 0, sizeof ok);
   while (1)
     {
-      const char *percent = strchr (fmt, '%');
+      const char *percent = (const char *) memchr (fmt, '%', f_end - fmt);
       if (!percent)
         {
-          obstack_grow (obs, fmt, strlen (fmt));
+          obstack_grow (obs, fmt, f_end - fmt);
           return;
         }
       obstack_grow (obs, fmt, percent - fmt);
@@ -305,7 +314,7 @@ expand_format (struct obstack *obs, int argc, token_data **argv)
         {
           M4ERROR ((warning_status, 0,
                     "Warning: unrecognized specifier in `%s'", f));
-          if (c == '\0')
+          if (fmt > f_end)
             fmt--;
           continue;
         }
@@ -367,8 +376,24 @@ expand_format (struct obstack *obs, int argc, token_data **argv)
           break;
 
         case STR:
-          str = xasprintf (fstart, width, prec, ARG_STR(argc, argv));
-          break;
+          /* Copy by length rather than through printf, so that NUL
+             bytes in the argument are kept.  */
+          len = ARG_LEN (argc, argv);
+          arg = ARG_STR (argc, argv);
+          if (0 <= prec && (size_t) prec < len)
+            len = prec;
+          if (width < 0)
+            {
+              flags |= MINUS;
+              width = width == INT_MIN ? INT_MAX : -width;
+            }
+          if (flags & MINUS)
+            obstack_grow (obs, arg, len);
+          for (; len < (size_t) width; width--)
+            obstack_1grow (obs, ' ');
+          if (!(flags & MINUS))
+            obstack_grow (obs, arg, len);
+          continue;
 
         default:
           abort();
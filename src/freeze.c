@@ -43,6 +43,73 @@ reverse_symbol_list (symbol *sym)
   return result;
 }
 
+/*-------------------------------------------------------------------.
+| Produce the frozen state of the symbol TOP to FILE, with all of    |
+| its definitions.  Shadowed definitions are handled along with the  |
+| current one, so they are ignored here.                             |
+`-------------------------------------------------------------------*/
+
+static void
+freeze_one_symbol (symbol *top, void *file_ptr)
+{
+  FILE *file = (FILE *) file_ptr;
+  symbol *sym;
+  const builtin *bp;
+
+  if (SYMBOL_SHADOWED (top))
+    return;
+
+  /* Process all definitions of the name, from the oldest to the
+     current one.  This order ensures that, at reload time, pushdef's
+     will be executed with the oldest definitions first.  */
+
+  top = reverse_symbol_list (top);
+  for (sym = top; sym; sym = SYMBOL_NEXT (sym))
+    {
+      switch (SYMBOL_TYPE (sym))
+        {
+        case TOKEN_TEXT:
+          xfprintf (file, "T%d,%d\n",
+                    (int) SYMBOL_NAME_LEN (sym),
+                    (int) SYMBOL_TEXT_LEN (sym));
+          fputs (SYMBOL_NAME (sym), file);
+          fwrite (SYMBOL_TEXT (sym), 1, SYMBOL_TEXT_LEN (sym), file);
+          fputc ('\n', file);
+          break;
+
+        case TOKEN_FUNC:
+          bp = find_builtin_by_addr (SYMBOL_FUNC (sym));
+          if (bp == NULL)
+            {
+              M4ERROR ((warning_status, 0, "\
+INTERNAL ERROR: builtin not found in builtin table!"));
+              abort ();
+            }
+          xfprintf (file, "F%d,%d\n",
+                    (int) SYMBOL_NAME_LEN (sym),
+                    (int) strlen (bp->name));
+          fputs (SYMBOL_NAME (sym), file);
+          fputs (bp->name, file);
+          fputc ('\n', file);
+          break;
+
+        case TOKEN_VOID:
+          /* Ignore placeholder tokens that exist due to traceon.  */
+          break;
+
+        default:
+          M4ERROR ((warning_status, 0, "\
+INTERNAL ERROR: bad token data type in freeze_one_symbol ()"));
+          abort ();
+          break;
+        }
+    }
+
+  /* Reverse the list once more, putting it back as it was.  */
+
+  reverse_symbol_list (top);
+}
+
 /*------------------------------------------------.
 | Produce a frozen state to the given file NAME.  |
 `------------------------------------------------*/
@@ -51,9 +118,6 @@ void
 produce_frozen_state (const char *name)
 {
   FILE *file;
-  size_t h;
-  symbol *sym;
-  const builtin *bp;
 
   file = fopen (name, O_BINARY ? "wb" : "w");
   if (!file)
@@ -90,59 +154,7 @@ produce_frozen_state (const char *name)
 
   /* Dump all symbols.  */
 
-  for (h = 0; h < hash_table_size; h++)
-    {
-
-      /* Process all entries in one bucket, from the last to the first.
-         This order ensures that, at reload time, pushdef's will be
-         executed with the oldest definitions first.  */
-
-      symtab[h] = reverse_symbol_list (symtab[h]);
-      for (sym = symtab[h]; sym; sym = SYMBOL_NEXT (sym))
-        {
-          switch (SYMBOL_TYPE (sym))
-            {
-            case TOKEN_TEXT:
-              xfprintf (file, "T%d,%d\n",
-                        (int) strlen (SYMBOL_NAME (sym)),
-                        (int) strlen (SYMBOL_TEXT (sym)));
-              fputs (SYMBOL_NAME (sym), file);
-              fputs (SYMBOL_TEXT (sym), file);
-              fputc ('\n', file);
-              break;
-
-            case TOKEN_FUNC:
-              bp = find_builtin_by_addr (SYMBOL_FUNC (sym));
-              if (bp == NULL)
-                {
-                  M4ERROR ((warning_status, 0, "\
-INTERNAL ERROR: builtin not found in builtin table!"));
-                  abort ();
-                }
-              xfprintf (file, "F%d,%d\n",
-                        (int) strlen (SYMBOL_NAME (sym)),
-                        (int) strlen (bp->name));
-              fputs (SYMBOL_NAME (sym), file);
-              fputs (bp->name, file);
-              fputc ('\n', file);
-              break;
-
-            case TOKEN_VOID:
-              /* Ignore placeholder tokens that exist due to traceon.  */
-              break;
-
-            default:
-              M4ERROR ((warning_status, 0, "\
-INTERNAL ERROR: bad token data type in freeze_one_symbol ()"));
-              abort ();
-              break;
-            }
-        }
-
-      /* Reverse the bucket once more, putting it back as it was.  */
-
-      symtab[h] = reverse_symbol_list (symtab[h]);
-    }
+  hack_all_symbols (freeze_one_symbol, file);
 
   /* Let diversions be issued from output.c module, its cleaner to have this
      piece of code there.  */
@@ -361,7 +373,8 @@ reload_frozen_state (const char *name)
 
               /* Enter a macro having an expansion text as a definition.  */
 
-              define_user_macro (string[0], string[1], SYMBOL_PUSHDEF);
+              define_user_macro (string[0], string[1], number[1],
+                                 SYMBOL_PUSHDEF);
               break;
 
             case 'Q':
@@ -24,6 +24,10 @@
 
 #include "memchr2.h"
 
+#if HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
 /* Unread input can be either files, that should be read (eg. included
    files), strings, which should be rescanned (eg. macro expansion text),
    or quoted macro definitions (as returned by the builtin "defn").
@@ -57,17 +61,45 @@
    applies to text resulting from macro expansions.  So each input
    block maintains its own notion of the current file and line, and
    swapping between input blocks updates the global variables
-   accordingly.  */
-
-#ifdef ENABLE_CHANGEWORD
-#include "regex.h"
-#endif
+   accordingly.
+
+   Files are not read through stdio a character at a time.  Instead,
+   each file input block owns a buffer, refilled by read(2) in large
+   chunks, and both strings and files expose their unread text through
+   the same STRING and END pointers.  This lets next_char () consume
+   file text with the same pointer bump used for strings, leaving
+   next_char_1 () to handle refills, line counting and EOF.  With
+   --mmap-input, large regular files are instead mapped into memory
+   whole, and scanned in place.
+
+   When $@, $* or shift expand a long argument list, the arguments are
+   not copied into the expansion text.  refer_to_args () instead
+   records a reference to them, and push_string_finish () splits the
+   expansion around an argv input block, which presents the arguments,
+   quotes and separating commas as a series of short buffers.  When
+   such a block is rescanned at a quoted argument that the current
+   quotes would read back unchanged, next_token () returns the shared
+   argument text as a string token without scanning it, and
+   expand_argument () in macro.c can adopt it whole as an argument of
+   the next call.  So recursing on shift($@) costs a pointer per
+   argument and level, rather than a copy of the whole list.  */
 
 enum input_type
 {
   INPUT_STRING,         /* String resulting from macro expansion.  */
   INPUT_FILE,           /* File from command line or include.  */
-  INPUT_MACRO           /* Builtin resulting from defn.  */
+  INPUT_MACRO,          /* Builtin resulting from defn.  */
+  INPUT_ARGV            /* Arguments referred to by $@, $* or shift.  */
+};
+
+/* The buffers that an argv input block presents in turn, for each
+   argument.  */
+enum argv_segment
+{
+  ARGV_SEP,             /* comma, before all but the first argument */
+  ARGV_LQUOTE,          /* left quote, if quoted */
+  ARGV_TEXT,            /* argument text */
+  ARGV_RQUOTE           /* right quote, if quoted */
 };
 
 typedef enum input_type input_type;
@@ -78,22 +110,29 @@ struct input_block
   input_type type;              /* see enum values */
   const char *file;             /* file where this input is from */
   int line;                     /* line where this input is from */
+  char *string;                 /* remaining buffered text */
+  char *end;                    /* end of buffered text */
   union
     {
-      struct
-        {
-          char *string;         /* remaining string value */
-          char *end;            /* terminating NUL of string */
-        }
-        u_s;    /* INPUT_STRING */
       struct
         {
           FILE *fp;                  /* input file handle */
-          bool_bitfield end : 1;     /* true if peek has seen EOF */
+          char *buffer;              /* start of read buffer or mapping */
+          size_t size;               /* allocated size of buffer */
+          int error;                 /* errno of a failed read, or 0 */
+          bool_bitfield end : 1;     /* true if read has seen EOF */
+          bool_bitfield mapped : 1;  /* true if buffer is a mapping */
           bool_bitfield close : 1;   /* true if we should close file on pop */
           bool_bitfield advance : 1; /* track previous start_of_input_line */
         }
         u_f;    /* INPUT_FILE */
+      struct
+        {
+          shared_args *args;         /* the argument list */
+          int index;                 /* argument being read */
+          enum argv_segment segment; /* segment of it in STRING */
+        }
+        u_a;    /* INPUT_ARGV */
       builtin_func *func;       /* pointer to macro's function */
     }
   u;
@@ -123,6 +162,10 @@ static struct obstack *current_input;
 /* Bottom of token_stack, for obstack_free.  */
 static void *token_bottom;
 
+/* Text of every single character token, so that those tokens need
+   not be collected on token_stack.  */
+static char char_tokens[UCHAR_MAX + 1][2];
+
 /* Pointer to top of current_input.  */
 static input_block *isp;
 
@@ -132,6 +175,33 @@ static input_block *wsp;
 /* Aux. for handling split push_string ().  */
 static input_block *next;
 
+/* Argument references made by refer_to_args () since the last
+   push_string_init (), each with the offset in the expansion text
+   where it belongs.  */
+struct pending_ref
+{
+  size_t offset;
+  shared_args *args;
+};
+
+static struct pending_ref *pending_refs;
+static size_t pending_count;
+static size_t pending_alloc;
+
+/* Argument lists read as part of the last string token, holding a
+   reference each until the next call of next_token ().  */
+static text_ref *token_refs;
+static int token_nrefs;
+static size_t token_refs_alloc;
+
+/* Incremented on each change of quotes, so that shared argument text
+   need only be checked once for balanced quotes.  Zero is never a
+   valid age.  */
+static int quote_age = 1;
+
+/* Separator between the arguments of an argv input block.  */
+static char argv_comma[] = ",";
+
 /* Flag for next_char () to increment current_line.  */
 static bool start_of_input_line;
 
@@ -141,6 +211,16 @@ static bool input_change;
 #define CHAR_EOF        256     /* character return on EOF */
 #define CHAR_MACRO      257     /* character return for MACRO token */
 
+/* Size of the read buffer of a file input block.  Regular files
+   smaller than this get a buffer just large enough to see EOF, and
+   are not worth mapping even with --mmap-input.  */
+#define INPUT_BUFFER_SIZE (64 * 1024)
+
+/* Below both of these sizes, copying an argument list is cheaper than
+   referring to it, unless some argument is already shared.  */
+#define ARGV_REF_MIN_ARGS 8
+#define ARGV_REF_MIN_BYTES 256
+
 /* Quote chars.  */
 STRING rquote;
 STRING lquote;
@@ -153,9 +233,8 @@ STRING ecomm;
 
 # define DEFAULT_WORD_REGEXP "[_a-zA-Z][_a-zA-Z0-9]*"
 
-static struct re_pattern_buffer word_regexp;
+static pattern_buffer *word_regexp;
 static int default_word_regexp;
-static struct re_registers regs;
 
 #else /* ! ENABLE_CHANGEWORD */
 # define default_word_regexp 1
@@ -166,23 +245,41 @@ static const char *token_type_string (token_type);
 #endif
 
 
+/*-----------------------------------------------------------------.
+| Forget the argument references made for an expansion that will  |
+| not be pushed after all.                                         |
+`-----------------------------------------------------------------*/
+
+static void
+discard_pending_refs (void)
+{
+  while (pending_count > 0)
+    release_shared_args (pending_refs[--pending_count].args);
+}
+
 /*-------------------------------------------------------------------.
 | push_file () pushes an input file on the input stack, saving the   |
 | current file name and line number.  If next is non-NULL, this push |
 | invalidates a call to push_string_init (), whose storage is        |
 | consequently released.  If CLOSE_WHEN_DONE, then close FP after    |
-| EOF is detected.                                                   |
+| EOF is detected.  The read buffer is allocated on the input stack  |
+| right after the block, so it is released along with it.  If        |
+| mmap_input, a large regular file other than stdin is mapped        |
+| instead, falling back to the read buffer if that fails.            |
 `-------------------------------------------------------------------*/
 
 void
 push_file (FILE *fp, const char *title, bool close_when_done)
 {
   input_block *i;
+  struct stat st;
+  size_t size = INPUT_BUFFER_SIZE;
 
   if (next != NULL)
     {
       obstack_free (current_input, next);
       next = NULL;
+      discard_pending_refs ();
     }
 
   if (debug_level & DEBUG_TRACE_INPUT)
@@ -196,7 +293,42 @@ push_file (FILE *fp, const char *title, bool close_when_done)
   input_change = true;
 
   i->u.u_f.fp = fp;
+  i->u.u_f.error = 0;
   i->u.u_f.end = false;
+  i->u.u_f.mapped = false;
+  if (fstat (fileno (fp), &st) == 0 && S_ISREG (st.st_mode))
+    {
+      if (st.st_size < size)
+        size = st.st_size + 1;
+#if HAVE_SYS_MMAN_H
+      /* Only map a file we know to be positioned at its start.  */
+      else if (mmap_input && fileno (fp) != STDIN_FILENO
+               && (size_t) st.st_size == st.st_size
+               && lseek (fileno (fp), 0, SEEK_CUR) == 0)
+        {
+          void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                            fileno (fp), 0);
+          if (map != MAP_FAILED)
+            {
+# ifdef MADV_SEQUENTIAL
+              madvise (map, st.st_size, MADV_SEQUENTIAL);
+# endif
+              i->u.u_f.buffer = (char *) map;
+              i->u.u_f.size = st.st_size;
+              i->u.u_f.end = true;
+              i->u.u_f.mapped = true;
+              i->string = i->u.u_f.buffer;
+              i->end = i->u.u_f.buffer + st.st_size;
+            }
+        }
+#endif /* HAVE_SYS_MMAN_H */
+    }
+  if (!i->u.u_f.mapped)
+    {
+      i->u.u_f.buffer = (char *) obstack_alloc (current_input, size);
+      i->u.u_f.size = size;
+      i->string = i->end = i->u.u_f.buffer;
+    }
   i->u.u_f.close = close_when_done;
   i->u.u_f.advance = start_of_input_line;
   output_current_line = -1;
@@ -220,6 +352,7 @@ push_macro (builtin_func *func)
     {
       obstack_free (current_input, next);
       next = NULL;
+      discard_pending_refs ();
     }
 
   i = (input_block *) obstack_alloc (current_input,
@@ -229,6 +362,7 @@ push_macro (builtin_func *func)
   i->line = current_line;
   input_change = true;
 
+  i->string = i->end = NULL;
   i->u.func = func;
   i->prev = isp;
   isp = i;
@@ -258,6 +392,122 @@ push_string_init (void)
   return current_input;
 }
 
+/*-------------------------------------------------------------------.
+| Record that the argument list ARGS, whose reference passes to the  |
+| input stack, belongs at the current end of the expansion OBS.      |
+`-------------------------------------------------------------------*/
+
+static void
+add_pending_ref (struct obstack *obs, shared_args *args)
+{
+  if (pending_count == pending_alloc)
+    pending_refs = (struct pending_ref *) x2nrealloc (pending_refs,
+                                                      &pending_alloc,
+                                                      sizeof *pending_refs);
+  pending_refs[pending_count].offset = obstack_object_size (obs);
+  pending_refs[pending_count].args = args;
+  pending_count++;
+}
+
+/*-------------------------------------------------------------------.
+| Record, in place of appending them to the expansion OBS being      |
+| built since push_string_init (), a reference to the arguments 1 to |
+| ARGC - 1 of ARGV, separated by commas and quoted by the current    |
+| quotes if QUOTED, as $@, $* and shift expand to.  Any argument not |
+| yet shared is copied once into a shared_text, which ARGV keeps     |
+| until the end of the call.  Return false without doing anything if |
+| OBS is not an expansion, if the expansion is traced and so must be |
+| plain text, or if the arguments are too short to be worth it; the  |
+| caller then copies them as usual.                                  |
+`-------------------------------------------------------------------*/
+
+bool
+refer_to_args (struct obstack *obs, int argc, token_data **argv,
+               bool quoted)
+{
+  shared_args *args;
+  size_t bytes = 0;
+  bool shared = false;
+  int i;
+
+  if (obs != current_input || next == NULL || expansion_traced || argc < 2)
+    return false;
+  for (i = 1; i < argc; i++)
+    {
+      if (TOKEN_DATA_TYPE (argv[i]) != TOKEN_TEXT)
+        return false;
+      if (TOKEN_DATA_SHARED (argv[i]) != NULL)
+        shared = true;
+      bytes += TOKEN_DATA_LEN (argv[i]);
+    }
+  if (!shared && argc - 1 < ARGV_REF_MIN_ARGS && bytes < ARGV_REF_MIN_BYTES)
+    return false;
+
+  args = (shared_args *) xmalloc (sizeof *args);
+  args->refs = 1;
+  args->argc = argc - 1;
+  args->argv = (shared_text **) xnmalloc (argc - 1, sizeof *args->argv);
+  args->lquote.string = xstrdup (quoted ? lquote.string : "");
+  args->lquote.length = quoted ? lquote.length : 0;
+  args->rquote.string = xstrdup (quoted ? rquote.string : "");
+  args->rquote.length = quoted ? rquote.length : 0;
+  share_args (argc, argv);
+  for (i = 1; i < argc; i++)
+    {
+      shared_text *st = TOKEN_DATA_SHARED (argv[i]);
+      st->refs++;
+      args->argv[i - 1] = st;
+    }
+  add_pending_ref (obs, args);
+  return true;
+}
+
+/*-------------------------------------------------------------------.
+| Append the text of the macro argument ARG to the expansion OBS.    |
+| If ARG came from a string holding argument lists referred to by    |
+| $@, $* or shift, those lists are referred to again rather than     |
+| copied, so that they survive being passed through, say, the branch |
+| of an ifelse.                                                      |
+`-------------------------------------------------------------------*/
+
+void
+append_arg_text (struct obstack *obs, token_data *arg)
+{
+  const char *text = TOKEN_DATA_TEXT (arg);
+  size_t done = 0;
+  int i;
+
+  if (obs == current_input && next != NULL && !expansion_traced)
+    for (i = 0; i < TOKEN_DATA_NREFS (arg); i++)
+      {
+        text_ref *ref = &TOKEN_DATA_REFS (arg)[i];
+
+        obstack_grow (obs, text + done, ref->offset - done);
+        ref->args->refs++;
+        add_pending_ref (obs, ref->args);
+        done = ref->offset + ref->len;
+      }
+  obstack_grow (obs, text + done, TOKEN_DATA_LEN (arg) - done);
+}
+
+/*-------------------------------------------------------------------.
+| Push a copy of BLOCK on the input stack, as part of the expansion  |
+| described by next.                                                 |
+`-------------------------------------------------------------------*/
+
+static void
+push_expansion_block (input_block *block)
+{
+  input_block *i;
+
+  i = (input_block *) obstack_copy (current_input, block,
+                                    sizeof (struct input_block));
+  i->file = next->file;
+  i->line = next->line;
+  i->prev = isp;
+  isp = i;
+}
+
 /*-------------------------------------------------------------------.
 | Last half of push_string ().  If next is now NULL, a call to       |
 | push_file () has invalidated the previous call to push_string_init |
@@ -266,25 +516,58 @@ push_string_init (void)
 | finished object.  This pointer is only for temporary use, since    |
 | reading the next token might release the memory used for the       |
 | object.                                                            |
+|                                                                    |
+| If argument lists were referred to, next holds only the text after |
+| the last reference, and argv blocks for the references and the     |
+| text pieces between them are pushed above it.  They are all        |
+| allocated after the text, so popping next releases the text last.  |
 `-------------------------------------------------------------------*/
 
 const char *
 push_string_finish (void)
 {
   const char *ret = NULL;
+  size_t len = obstack_object_size (current_input);
+  input_block piece;
+  input_block argv_block;
+  char *text;
 
   if (next == NULL)
-    return NULL;
+    {
+      discard_pending_refs ();
+      return NULL;
+    }
 
-  if (obstack_object_size (current_input) > 0)
+  if (len > 0 || pending_count > 0)
     {
-      size_t len = obstack_object_size (current_input);
       obstack_1grow (current_input, '\0');
-      next->u.u_s.string = (char *) obstack_finish (current_input);
-      next->u.u_s.end = next->u.u_s.string + len;
+      text = (char *) obstack_finish (current_input);
+      next->string = text;
+      if (pending_count > 0)
+        next->string += pending_refs[pending_count - 1].offset;
+      next->end = text + len;
       next->prev = isp;
       isp = next;
-      ret = isp->u.u_s.string; /* for immediate use only */
+
+      piece.type = INPUT_STRING;
+      argv_block.type = INPUT_ARGV;
+      argv_block.string = argv_block.end = NULL;
+      argv_block.u.u_a.index = 0;
+      argv_block.u.u_a.segment = ARGV_SEP;
+      while (pending_count > 0)
+        {
+          struct pending_ref *ref = &pending_refs[--pending_count];
+
+          argv_block.u.u_a.args = ref->args;
+          push_expansion_block (&argv_block);
+          piece.string = text;
+          if (pending_count > 0)
+            piece.string += pending_refs[pending_count - 1].offset;
+          piece.end = text + ref->offset;
+          if (piece.string < piece.end)
+            push_expansion_block (&piece);
+        }
+      ret = text; /* for immediate use only */
       input_change = true;
     }
   else
@@ -294,18 +577,17 @@ push_string_finish (void)
 }
 
 /*------------------------------------------------------------------.
-| The function push_wrapup () pushes a string on the wrapup stack.  |
-| When the normal input stack gets empty, the wrapup stack will     |
-| become the input stack, and push_string () and push_file () will  |
-| operate on wrapup_stack.  Push_wrapup should be done as           |
-| push_string (), but this will suffice, as long as arguments to    |
-| m4_m4wrap () are moderate in size.                                |
+| The function push_wrapup () pushes a string S of length LEN on    |
+| the wrapup stack.  When the normal input stack gets empty, the    |
+| wrapup stack will become the input stack, and push_string () and  |
+| push_file () will operate on wrapup_stack.  Push_wrapup should be |
+| done as push_string (), but this will suffice, as long as         |
+| arguments to m4_m4wrap () are moderate in size.                   |
 `------------------------------------------------------------------*/
 
 void
-push_wrapup (const char *s)
+push_wrapup (const char *s, size_t len)
 {
-  size_t len = strlen (s);
   input_block *i;
   i = (input_block *) obstack_alloc (wrapup_stack,
                                      sizeof (struct input_block));
@@ -313,8 +595,8 @@ push_wrapup (const char *s)
   i->type = INPUT_STRING;
   i->file = current_file;
   i->line = current_line;
-  i->u.u_s.string = (char *) obstack_copy0 (wrapup_stack, s, len);
-  i->u.u_s.end = i->u.u_s.string + len;
+  i->string = (char *) obstack_copy0 (wrapup_stack, s, len);
+  i->end = i->string + len;
   wsp = i;
 }
 
@@ -337,6 +619,10 @@ pop_input (void)
     case INPUT_MACRO:
       break;
 
+    case INPUT_ARGV:
+      release_shared_args (isp->u.u_a.args);
+      break;
+
     case INPUT_FILE:
       if (debug_level & DEBUG_TRACE_INPUT)
         {
@@ -347,9 +633,13 @@ pop_input (void)
             DEBUG_MESSAGE ("input exhausted");
         }
 
-      if (ferror (isp->u.u_f.fp))
+#if HAVE_SYS_MMAN_H
+      if (isp->u.u_f.mapped)
+        munmap (isp->u.u_f.buffer, isp->u.u_f.size);
+#endif
+      if (isp->u.u_f.error)
         {
-          M4ERROR ((warning_status, 0, "read error"));
+          M4ERROR ((warning_status, isp->u.u_f.error, "read error"));
           if (isp->u.u_f.close)
             fclose (isp->u.u_f.fp);
           retcode = EXIT_FAILURE;
@@ -395,10 +685,14 @@ pop_wrapup (void)
          to exit, since it makes leak detection easier.  */
       obstack_free (&token_stack, NULL);
       obstack_free (&file_names, NULL);
+      free (token_refs);
+      free (pending_refs);
       obstack_free (wrapup_stack, NULL);
       free (wrapup_stack);
 #ifdef ENABLE_CHANGEWORD
-      regfree (&word_regexp);
+      if (word_regexp)
+        free_pattern (word_regexp);
+      word_regexp = NULL;
 #endif /* ENABLE_CHANGEWORD */
       return false;
     }
@@ -434,6 +728,113 @@ init_macro_token (token_data *td)
 }
 
 
+/*-------------------------------------------------------------------.
+| Refill the read buffer of the file input block BLOCK, which must   |
+| have no buffered text left.  Return false on EOF or read error.    |
+| Once EOF is seen, the file is never read again: if stdin is a      |
+| terminal, reading after EOF was already seen would make the user   |
+| have to hit ^D twice to quit.                                      |
+`-------------------------------------------------------------------*/
+
+static bool
+fill_input_buffer (input_block *block)
+{
+  ssize_t len;
+
+  if (block->u.u_f.end)
+    return false;
+  do
+    len = read (fileno (block->u.u_f.fp), block->u.u_f.buffer,
+                block->u.u_f.size);
+  while (len < 0 && errno == EINTR);
+  if (len <= 0)
+    {
+      if (len < 0)
+        block->u.u_f.error = errno;
+      block->u.u_f.end = true;
+      return false;
+    }
+  block->string = block->u.u_f.buffer;
+  block->end = block->u.u_f.buffer + len;
+  return true;
+}
+
+/*-------------------------------------------------------------------.
+| Since file input is read ahead into private buffers, the file      |
+| offset of stdin may be past the text actually consumed.  POSIX     |
+| requires that the offset of a seekable stdin reflect what m4 has   |
+| read, so sync_input_files () gives back any buffered stdin text to |
+| the underlying file before another process might inherit it.  It   |
+| is called from debug_flush_files ().                               |
+`-------------------------------------------------------------------*/
+
+void
+sync_input_files (void)
+{
+  input_block *block;
+
+  for (block = isp; block != NULL; block = block->prev)
+    if (block->type == INPUT_FILE
+        && fileno (block->u.u_f.fp) == STDIN_FILENO
+        && block->string < block->end
+        && lseek (STDIN_FILENO, block->string - block->end, SEEK_CUR) >= 0)
+      block->string = block->end;
+}
+
+/*------------------------------------------------------------------.
+| Point the argv input block BLOCK at its next non-empty segment.   |
+| Return false once all its arguments have been read.               |
+`------------------------------------------------------------------*/
+
+static bool
+next_argv_segment (input_block *block)
+{
+  shared_args *args = block->u.u_a.args;
+
+  while (1)
+    {
+      STRING seg;
+
+      if (block->u.u_a.segment == ARGV_RQUOTE)
+        {
+          block->u.u_a.segment = ARGV_SEP;
+          block->u.u_a.index++;
+        }
+      else
+        block->u.u_a.segment++;
+      if (block->u.u_a.index >= args->argc)
+        return false;
+
+      switch (block->u.u_a.segment)
+        {
+        case ARGV_SEP:
+          seg.string = argv_comma;
+          seg.length = block->u.u_a.index > 0;
+          break;
+
+        case ARGV_LQUOTE:
+          seg = args->lquote;
+          break;
+
+        case ARGV_TEXT:
+          seg.string = args->argv[block->u.u_a.index]->text;
+          seg.length = args->argv[block->u.u_a.index]->len;
+          break;
+
+        case ARGV_RQUOTE:
+        default:
+          seg = args->rquote;
+          break;
+        }
+      if (seg.length > 0)
+        {
+          block->string = seg.string;
+          block->end = seg.string + seg.length;
+          return true;
+        }
+    }
+}
+
 /*-----------------------------------------------------------------.
 | Low level input is done a character at a time.  The function     |
 | peek_input () is used to look at the next character in the input |
@@ -444,7 +845,6 @@ init_macro_token (token_data *td)
 static int
 peek_input (void)
 {
-  int ch;
   input_block *block = isp;
 
   while (1)
@@ -455,24 +855,23 @@ peek_input (void)
       switch (block->type)
         {
         case INPUT_STRING:
-          ch = to_uchar (block->u.u_s.string[0]);
-          if (ch != '\0')
-            return ch;
+          if (block->string < block->end)
+            return to_uchar (*block->string);
           break;
 
         case INPUT_FILE:
-          ch = getc (block->u.u_f.fp);
-          if (ch != EOF)
-            {
-              ungetc (ch, block->u.u_f.fp);
-              return ch;
-            }
-          block->u.u_f.end = true;
+          if (block->string < block->end || fill_input_buffer (block))
+            return to_uchar (*block->string);
           break;
 
         case INPUT_MACRO:
           return CHAR_MACRO;
 
+        case INPUT_ARGV:
+          if (block->string < block->end || next_argv_segment (block))
+            return to_uchar (*block->string);
+          break;
+
         default:
           M4ERROR ((warning_status, 0,
                     "INTERNAL ERROR: input stack botch in peek_input ()"));
@@ -488,14 +887,16 @@ peek_input (void)
 | messages, so they do not get wrong, due to lookahead.  The token   |
 | consisting of a newline alone is taken as belonging to the line it |
 | ends, and the current line number is not incremented until the     |
-| next character is read.  99.9% of all calls will read from a       |
-| string, so factor that out into a macro for speed.                 |
+| next character is read.  99.9% of all calls will read buffered    |
+| text that needs no line bookkeeping, so factor that out into a     |
+| macro for speed.                                                   |
 `-------------------------------------------------------------------*/
 
-#define next_char() \
-  (isp && isp->type == INPUT_STRING && isp->u.u_s.string[0]     \
-   && !input_change                                             \
-   ? to_uchar (*isp->u.u_s.string++)                            \
+#define next_char()                                                     \
+  (isp && isp->string < isp->end && !input_change                       \
+   && (isp->type != INPUT_FILE                                          \
+       || (!start_of_input_line && *isp->string != '\n'))               \
+   ? to_uchar (*isp->string++)                                          \
    : next_char_1 ())
 
 static int
@@ -522,9 +923,8 @@ next_char_1 (void)
       switch (isp->type)
         {
         case INPUT_STRING:
-          ch = to_uchar (*isp->u.u_s.string++);
-          if (ch != '\0')
-            return ch;
+          if (isp->string < isp->end)
+            return to_uchar (*isp->string++);
           break;
 
         case INPUT_FILE:
@@ -534,12 +934,9 @@ next_char_1 (void)
               current_line = ++isp->line;
             }
 
-          /* If stdin is a terminal, calling getc after peek_input
-             already called it would make the user have to hit ^D
-             twice to quit.  */
-          ch = isp->u.u_f.end ? EOF : getc (isp->u.u_f.fp);
-          if (ch != EOF)
+          if (isp->string < isp->end || fill_input_buffer (isp))
             {
+              ch = to_uchar (*isp->string++);
               if (ch == '\n')
                 start_of_input_line = true;
               return ch;
@@ -550,6 +947,11 @@ next_char_1 (void)
           pop_input (); /* INPUT_MACRO input sources has only one token */
           return CHAR_MACRO;
 
+        case INPUT_ARGV:
+          if (isp->string < isp->end || next_argv_segment (isp))
+            return to_uchar (*isp->string++);
+          break;
+
         default:
           M4ERROR ((warning_status, 0,
                     "INTERNAL ERROR: input stack botch in next_char ()"));
@@ -561,6 +963,32 @@ next_char_1 (void)
     }
 }
 
+/*-------------------------------------------------------------------.
+| Consume the next LEN bytes of buffered text from the top input     |
+| block in bulk, updating line numbers of a file just like LEN calls |
+| to next_char () would.                                             |
+`-------------------------------------------------------------------*/
+
+static void
+consume_buffer (size_t len)
+{
+  if (isp->type == INPUT_FILE && len > 0)
+    {
+      const char *p = isp->string;
+      const char *end = p + len;
+      int lines = start_of_input_line;
+
+      while ((p = (char *) memchr (p, '\n', end - p)) != NULL)
+        {
+          lines++;
+          p++;
+        }
+      start_of_input_line = end[-1] == '\n';
+      current_line = isp->line += lines - start_of_input_line;
+    }
+  isp->string += len;
+}
+
 /*-------------------------------------------------------------------.
 | skip_line () simply discards all immediately following characters, |
 | upto the first newline.  It is only used from m4_dnl ().           |
@@ -665,6 +1093,8 @@ match_input (const char *s, bool consume)
 void
 input_init (void)
 {
+  int i;
+
   current_file = "";
   current_line = 0;
 
@@ -682,6 +1112,9 @@ input_init (void)
   obstack_alloc (&token_stack, 1);
   token_bottom = obstack_base (&token_stack);
 
+  for (i = 0; i <= UCHAR_MAX; i++)
+    char_tokens[i][0] = i;
+
   isp = NULL;
   wsp = NULL;
   next = NULL;
@@ -734,6 +1167,7 @@ set_quotes (const char *lq, const char *rq)
   lquote.length = strlen (lquote.string);
   rquote.string = xstrdup (rq);
   rquote.length = strlen (rquote.string);
+  quote_age++;
 }
 
 void
@@ -766,7 +1200,7 @@ void
 set_word_regexp (const char *regexp)
 {
   const char *msg;
-  struct re_pattern_buffer new_word_regexp;
+  pattern_buffer *pattern;
 
   if (!*regexp || STREQ (regexp, DEFAULT_WORD_REGEXP))
     {
@@ -774,29 +1208,18 @@ set_word_regexp (const char *regexp)
       return;
     }
 
-  /* Dry run to see whether the new expression is compilable.  */
-  init_pattern_buffer (&new_word_regexp, NULL);
-  msg = re_compile_pattern (regexp, strlen (regexp), &new_word_regexp);
-  regfree (&new_word_regexp);
-
-  if (msg != NULL)
+  /* The previous expression stays in effect unless this one compiles.
+     The fastmap of the result is ready for next_token () to use.  */
+  pattern = compile_pattern (regexp, strlen (regexp), &msg);
+  if (pattern == NULL)
     {
       M4ERROR ((warning_status, 0,
                 "bad regular expression `%s': %s", regexp, msg));
       return;
     }
-
-  /* If compilation worked, retry using the word_regexp struct.  We
-     can't rely on struct assigns working, so redo the compilation.
-     The fastmap can be reused between compilations, and will be freed
-     by the final regfree.  */
-  if (!word_regexp.fastmap)
-    word_regexp.fastmap = xcharalloc (UCHAR_MAX + 1);
-  msg = re_compile_pattern (regexp, strlen (regexp), &word_regexp);
-  assert (!msg);
-  re_set_registers (&word_regexp, &regs, regs.num_regs, regs.start, regs.end);
-  if (re_compile_fastmap (&word_regexp))
-    assert (false);
+  if (word_regexp)
+    free_pattern (word_regexp);
+  word_regexp = pattern;
 
   default_word_regexp = false;
 }
@@ -804,6 +1227,286 @@ set_word_regexp (const char *regexp)
 #endif /* ENABLE_CHANGEWORD */
 
 
+/*-------------------------------------------------------------------.
+| Return true if the text of ARG, between the current quotes, would  |
+| be read back by next_token () as exactly one string holding that   |
+| text.  Only single byte quotes are handled.  The answer is         |
+| remembered until the quotes change.                                |
+`-------------------------------------------------------------------*/
+
+static bool
+argv_string_ok (shared_text *arg)
+{
+  const char *p = arg->text;
+  const char *end = arg->text + arg->len;
+  char lq = *lquote.string;
+  char rq = *rquote.string;
+  int level = 1;
+
+  if (arg->quote_age == quote_age)
+    return true;
+  if (lquote.length != 1 || rquote.length != 1)
+    return false;
+  while ((p = (char *) memchr2 (p, lq, rq, end - p)) != NULL)
+    {
+      /* As in next_token (), the right quote takes precedence.  */
+      if (*p++ == rq)
+        {
+          if (--level == 0)
+            return false;
+        }
+      else
+        level++;
+    }
+  if (level != 1)
+    return false;
+  arg->quote_age = quote_age;
+  return true;
+}
+
+/*-------------------------------------------------------------------.
+| Return the argv input block about to be read, if any.  An empty    |
+| string block above it, usually the text that came before the       |
+| reference in the same expansion, is popped first.                  |
+`-------------------------------------------------------------------*/
+
+static input_block *
+argv_block_top (void)
+{
+  if (isp != NULL && isp->type == INPUT_STRING && isp->string == isp->end
+      && isp->prev != NULL && isp->prev->type == INPUT_ARGV)
+    pop_input ();
+  if (isp == NULL || isp->type != INPUT_ARGV)
+    return NULL;
+  if (input_change)
+    {
+      current_file = isp->file;
+      current_line = isp->line;
+      input_change = false;
+    }
+  return isp;
+}
+
+/*------------------------------------------------------------------.
+| Return true if the current left quote, a single byte, starts a    |
+| string in next_token (), rather than a comment or a word.         |
+`------------------------------------------------------------------*/
+
+static bool
+lquote_starts_string (void)
+{
+  char lq = *lquote.string;
+
+  if (*bcomm.string == lq
+      || (default_word_regexp && (isalpha (to_uchar (lq)) || lq == '_')))
+    return false;
+#ifdef ENABLE_CHANGEWORD
+  if (!default_word_regexp && word_regexp->buf.fastmap[to_uchar (lq)])
+    return false;
+#endif
+  return true;
+}
+
+/*-------------------------------------------------------------------.
+| If the next input is the left quote of an argument in an argv      |
+| input block, and next_token () would read that quoted argument as  |
+| a string token of just its text, consume it and return the shared  |
+| argument; otherwise return NULL.  If COMMA, the argument must also |
+| be followed by a comma from the same block, which is consumed as   |
+| well.  Only single byte quotes, which cannot be mistaken for a     |
+| comment or word, are handled.                                      |
+`-------------------------------------------------------------------*/
+
+static shared_text *
+next_argv_string (bool comma)
+{
+  input_block *block = argv_block_top ();
+  shared_args *args;
+  shared_text *arg;
+
+  if (block == NULL
+      || (block->string == block->end && !next_argv_segment (block)))
+    return NULL;
+  args = block->u.u_a.args;
+  if (block->u.u_a.segment != ARGV_LQUOTE
+      || block->string != args->lquote.string
+      || (comma && block->u.u_a.index + 1 >= args->argc)
+      || !STREQ (args->lquote.string, lquote.string)
+      || !STREQ (args->rquote.string, rquote.string))
+    return NULL;
+  if (!lquote_starts_string ())
+    return NULL;
+
+  arg = args->argv[block->u.u_a.index];
+  if (!argv_string_ok (arg))
+    return NULL;
+
+  if (comma)
+    {
+      block->u.u_a.index++;
+      block->u.u_a.segment = ARGV_SEP;
+    }
+  else
+    block->u.u_a.segment = ARGV_RQUOTE;
+  block->string = block->end = NULL;
+  return arg;
+}
+
+/*-------------------------------------------------------------------.
+| Used by expand_argument () in macro.c to collect an argument read  |
+| back from $@ or shift without any tokens: if the next input is a   |
+| quoted argument followed by a comma, both from an argv input       |
+| block, consume them and return the argument, else return NULL.     |
+| The argument holds no new reference.                               |
+`-------------------------------------------------------------------*/
+
+shared_text *
+next_argv_arg (void)
+{
+  return next_argv_string (true);
+}
+
+/*-------------------------------------------------------------------.
+| Return the argv input block about to be read, if it has not been   |
+| read from yet and each of its quoted arguments would be read back  |
+| by next_token () as one string holding just its text; otherwise    |
+| return NULL.                                                       |
+`-------------------------------------------------------------------*/
+
+static input_block *
+argv_block_whole (void)
+{
+  input_block *block = argv_block_top ();
+  shared_args *args;
+  int i;
+
+  if (block == NULL || block->u.u_a.index > 0)
+    return NULL;
+  args = block->u.u_a.args;
+  switch (block->u.u_a.segment)
+    {
+    case ARGV_SEP:
+      break;
+
+    case ARGV_LQUOTE:
+      if (block->string != args->lquote.string)
+        return NULL;
+      break;
+
+    case ARGV_TEXT:
+      if (args->lquote.length > 0 || block->string != args->argv[0]->text)
+        return NULL;
+      break;
+
+    default:
+      return NULL;
+    }
+  /* Each quoted argument must nest, which fails if the right quote
+     is also the left one.  */
+  if (args->lquote.length > 0
+      && (!STREQ (args->lquote.string, lquote.string)
+          || !STREQ (args->rquote.string, rquote.string)
+          || STREQ (lquote.string, rquote.string)))
+    return NULL;
+  for (i = 0; i < args->argc; i++)
+    if (!argv_string_ok (args->argv[i]))
+      return NULL;
+  return block;
+}
+
+/*-------------------------------------------------------------------.
+| Inside a string, if the next input is the start of an argv input   |
+| block whose whole text would be read as part of the string, copy   |
+| that text to token_stack at once, and remember the argument list   |
+| in token_refs.  Return true if so.                                 |
+`-------------------------------------------------------------------*/
+
+static bool
+read_argv_block (void)
+{
+  input_block *block = argv_block_whole ();
+  shared_args *args;
+  text_ref *ref;
+  int i;
+
+  if (block == NULL)
+    return false;
+  args = block->u.u_a.args;
+  if ((size_t) token_nrefs == token_refs_alloc)
+    token_refs = (text_ref *) x2nrealloc (token_refs, &token_refs_alloc,
+                                          sizeof *token_refs);
+  ref = &token_refs[token_nrefs++];
+  ref->offset = obstack_object_size (&token_stack);
+  ref->args = args;
+  args->refs++;
+  for (i = 0; i < args->argc; i++)
+    {
+      if (i > 0)
+        obstack_1grow (&token_stack, ',');
+      obstack_grow (&token_stack, args->lquote.string, args->lquote.length);
+      obstack_grow (&token_stack, args->argv[i]->text, args->argv[i]->len);
+      obstack_grow (&token_stack, args->rquote.string, args->rquote.length);
+    }
+  ref->len = obstack_object_size (&token_stack) - ref->offset;
+
+  block->u.u_a.index = args->argc;
+  block->string = block->end = NULL;
+  return true;
+}
+
+/*-------------------------------------------------------------------.
+| Used by expand_argument () in macro.c inside parentheses, where    |
+| commas do not end the argument, as in the list `(shift$2)': if the |
+| next input is the start of an argv input block of quoted           |
+| arguments, each of which next_token () would read as a string of   |
+| just its text, append those texts separated by commas to OBS at    |
+| once, as reading them token by token would, and return true.       |
+`-------------------------------------------------------------------*/
+
+bool
+read_argv_text (struct obstack *obs)
+{
+  input_block *block = argv_block_whole ();
+  shared_args *args;
+  int i;
+
+  if (block == NULL || block->u.u_a.args->lquote.length == 0
+      || !lquote_starts_string ())
+    return false;
+  args = block->u.u_a.args;
+  for (i = 0; i < args->argc; i++)
+    {
+      if (i > 0)
+        obstack_1grow (obs, ',');
+      obstack_grow (obs, args->argv[i]->text, args->argv[i]->len);
+    }
+
+  block->u.u_a.index = args->argc;
+  block->string = block->end = NULL;
+  return true;
+}
+
+/*-------------------------------------------------------------------.
+| Mix into the hash VAL the whole words of bytes that token_stack    |
+| has gained past the HASHED bytes already mixed in, if any, and     |
+| advance HASHED past them.  Used while reading a word in            |
+| next_token (), so that hash_finish () has only the tail left.      |
+`-------------------------------------------------------------------*/
+
+#define HASH_TOKEN_WORDS(Val, Hashed)                                   \
+  do                                                                    \
+    {                                                                   \
+      size_t whole_ = ((obstack_object_size (&token_stack) - (Hashed))  \
+                       & ~(sizeof (size_t) - 1));                       \
+      if (whole_ > 0)                                                   \
+        {                                                               \
+          (Val) = hash_words ((Val), ((char *) obstack_base (&token_stack) \
+                                      + (Hashed)), whole_);             \
+          (Hashed) += whole_;                                           \
+        }                                                               \
+    }                                                                   \
+  while (0)
+
 /*--------------------------------------------------------------------.
 | Parse and return a single token from the input stream.  A token     |
 | can either be TOKEN_EOF, if the input_stack is empty; it can be     |
@@ -815,8 +1518,16 @@ set_word_regexp (const char *regexp)
 | Next_token () return the token type, and passes back a pointer to   |
 | the token data through TD.  The token text is collected on the      |
 | obstack token_stack, which never contains more than one token text  |
-| at a time.  The storage pointed to by the fields in TD is           |
-| therefore subject to change the next time next_token () is called.  |
+| at a time.  To avoid that copy, single characters come from a       |
+| static table, and a quoted string found whole within one input      |
+| buffer is referenced in place, without a terminating NUL; use the   |
+| token length rather than relying on one.  The storage pointed to by |
+| the fields in TD is therefore subject to change the next time       |
+| next_token () is called, or as soon as any other input is read.     |
+| A quoted argument from $@ or shift is returned without rescanning   |
+| it, as a string token whose text is shared; see refer_to_args ().   |
+| A string that contains such a whole argument list records where, in |
+| the token refs.                                                     |
 `--------------------------------------------------------------------*/
 
 token_type
@@ -831,11 +1542,37 @@ next_token (token_data *td, int *line)
 #endif
   const char *file;
   int dummy;
+  char *text = NULL;            /* token text, if not on token_stack */
+  size_t length = 0;            /* length of token text */
+  size_t hash = 0;              /* hash_text () of a word */
+  shared_text *shared;
 
   obstack_free (&token_stack, token_bottom);
+  while (token_nrefs > 0)
+    release_shared_args (token_refs[--token_nrefs].args);
   if (!line)
     line = &dummy;
 
+  shared = next_argv_string (false);
+  if (shared != NULL)
+    {
+      *line = current_line;
+      TOKEN_DATA_TYPE (td) = TOKEN_TEXT;
+      TOKEN_DATA_TEXT (td) = shared->text;
+      TOKEN_DATA_LEN (td) = shared->len;
+      TOKEN_DATA_SHARED (td) = shared;
+      TOKEN_DATA_REFS (td) = NULL;
+      TOKEN_DATA_NREFS (td) = 0;
+#ifdef ENABLE_CHANGEWORD
+      TOKEN_DATA_ORIG_TEXT (td) = shared->text;
+#endif
+#ifdef DEBUG_INPUT
+      xfprintf (stderr, "next_token -> STRING (%.*s)\n",
+                (int) shared->len, shared->text);
+#endif
+      return TOKEN_STRING;
+    }
+
  /* Can't consume character until after CHAR_MACRO is handled.  */
   ch = peek_input ();
   if (ch == CHAR_EOF)
@@ -878,19 +1615,48 @@ next_token (token_data *td, int *line)
     }
   else if (default_word_regexp && (isalpha (ch) || ch == '_'))
     {
+      /* The word is hashed a whole word of bytes at a time as it
+         grows, while it is still in cache; HASHED bytes are mixed in
+         so far.  */
+      size_t hashed = 0;
+
       obstack_1grow (&token_stack, ch);
-      while ((ch = peek_input ()) != CHAR_EOF && (isalnum (ch) || ch == '_'))
+      while (1)
         {
+          /* Try scanning a buffer first.  Words never span a newline,
+             so file text needs no line bookkeeping here.  */
+          if (isp && isp->string < isp->end && !input_change
+              && (isp->type != INPUT_FILE || !start_of_input_line))
+            {
+              char *p = isp->string;
+              while (p < isp->end && (isalnum (to_uchar (*p)) || *p == '_'))
+                p++;
+              obstack_grow (&token_stack, isp->string, p - isp->string);
+              isp->string = p;
+              HASH_TOKEN_WORDS (hash, hashed);
+              if (p < isp->end)
+                break;
+            }
+          /* Fall back to a byte.  */
+          ch = peek_input ();
+          if (ch == CHAR_EOF || !(isalnum (ch) || ch == '_'))
+            break;
           obstack_1grow (&token_stack, ch);
           next_char ();
+          HASH_TOKEN_WORDS (hash, hashed);
         }
+      length = obstack_object_size (&token_stack);
+      hash = hash_finish (hash, ((char *) obstack_base (&token_stack)
+                                 + hashed), length - hashed, length);
       type = TOKEN_WORD;
     }
 
 #ifdef ENABLE_CHANGEWORD
 
-  else if (!default_word_regexp && word_regexp.fastmap[ch])
+  else if (!default_word_regexp && word_regexp->buf.fastmap[ch])
     {
+      struct re_registers *regs = &word_regexp->regs;
+
       obstack_1grow (&token_stack, ch);
       while (1)
         {
@@ -898,12 +1664,12 @@ next_token (token_data *td, int *line)
           if (ch == CHAR_EOF)
             break;
           obstack_1grow (&token_stack, ch);
-          startpos = re_search (&word_regexp,
+          startpos = re_search (&word_regexp->buf,
                                 (char *) obstack_base (&token_stack),
                                 obstack_object_size (&token_stack), 0, 0,
-                                &regs);
+                                regs);
           if (startpos ||
-              regs.end [0] != (regoff_t) obstack_object_size (&token_stack))
+              regs->end [0] != (regoff_t) obstack_object_size (&token_stack))
             {
               *(((char *) obstack_base (&token_stack)
                  + obstack_object_size (&token_stack)) - 1) = '\0';
@@ -915,12 +1681,15 @@ next_token (token_data *td, int *line)
       obstack_1grow (&token_stack, '\0');
       orig_text = (char *) obstack_finish (&token_stack);
 
-      if (regs.start[1] != -1)
-        obstack_grow (&token_stack,orig_text + regs.start[1],
-                      regs.end[1] - regs.start[1]);
+      if (regs->start[1] != -1)
+        obstack_grow (&token_stack,orig_text + regs->start[1],
+                      regs->end[1] - regs->start[1]);
       else
-        obstack_grow (&token_stack, orig_text,regs.end[0]);
+        obstack_grow (&token_stack, orig_text,regs->end[0]);
 
+      /* The word is only the part of the match that was kept.  */
+      length = obstack_object_size (&token_stack);
+      hash = hash_text ((char *) obstack_base (&token_stack), length, 0);
       type = TOKEN_WORD;
     }
 
@@ -943,7 +1712,8 @@ next_token (token_data *td, int *line)
           type = TOKEN_SIMPLE;
           break;
         }
-      obstack_1grow (&token_stack, ch);
+      text = char_tokens[ch];
+      length = 1;
     }
   else
     {
@@ -951,12 +1721,17 @@ next_token (token_data *td, int *line)
       quote_level = 1;
       while (1)
         {
-          /* Try scanning a buffer first.  */
-          const char *buffer = (isp && isp->type == INPUT_STRING
-                                ? isp->u.u_s.string : NULL);
-          if (buffer && *buffer)
+          if (fast && read_argv_block ())
+            continue;
+
+          /* Try scanning a buffer first.  File text is only scanned
+             once next_char () has synced the current line.  */
+          const char *buffer = (isp && (isp->type != INPUT_FILE
+                                        || !input_change)
+                                ? isp->string : NULL);
+          if (buffer && buffer < isp->end)
             {
-              size_t len = isp->u.u_s.end - buffer;
+              size_t len = isp->end - buffer;
               const char *p = buffer;
               do
                 {
@@ -970,18 +1745,25 @@ next_token (token_data *td, int *line)
                   if (fast)
                     {
                       assert (!quote_level);
-                      obstack_grow (&token_stack, buffer, p - buffer - 1);
-                      isp->u.u_s.string += p - buffer;
+                      if (obstack_object_size (&token_stack) == 0)
+                        {
+                          /* The whole string is in this buffer.  */
+                          text = isp->string;
+                          length = p - buffer - 1;
+                        }
+                      else
+                        obstack_grow (&token_stack, buffer, p - buffer - 1);
+                      consume_buffer (p - buffer);
                       break;
                     }
                   obstack_grow (&token_stack, buffer, p - buffer);
                   ch = to_uchar (*p);
-                  isp->u.u_s.string += p - buffer + 1;
+                  consume_buffer (p - buffer + 1);
                 }
               else
                 {
                   obstack_grow (&token_stack, buffer, len);
-                  isp->u.u_s.string += len;
+                  consume_buffer (len);
                   continue;
                 }
             }
@@ -1011,18 +1793,29 @@ next_token (token_data *td, int *line)
       type = TOKEN_STRING;
     }
 
-  obstack_1grow (&token_stack, '\0');
+  if (text == NULL)
+    {
+      length = obstack_object_size (&token_stack);
+      obstack_1grow (&token_stack, '\0');
+      text = (char *) obstack_finish (&token_stack);
+    }
 
   TOKEN_DATA_TYPE (td) = TOKEN_TEXT;
-  TOKEN_DATA_TEXT (td) = (char *) obstack_finish (&token_stack);
+  TOKEN_DATA_TEXT (td) = text;
+  TOKEN_DATA_LEN (td) = length;
+  TOKEN_DATA_SHARED (td) = NULL;
+  TOKEN_DATA_REFS (td) = token_nrefs > 0 ? token_refs : NULL;
+  TOKEN_DATA_NREFS (td) = token_nrefs;
+  if (type == TOKEN_WORD)
+    TOKEN_DATA_HASH (td) = hash;
 #ifdef ENABLE_CHANGEWORD
   if (orig_text == NULL)
     orig_text = TOKEN_DATA_TEXT (td);
   TOKEN_DATA_ORIG_TEXT (td) = orig_text;
 #endif
 #ifdef DEBUG_INPUT
-  xfprintf (stderr, "next_token -> %s (%s)\n",
-            token_type_string (type), TOKEN_DATA_TEXT (td));
+  xfprintf (stderr, "next_token -> %s (%.*s)\n",
+            token_type_string (type), (int) length, TOKEN_DATA_TEXT (td));
 #endif
   return type;
 }
@@ -1051,7 +1844,7 @@ peek_token (void)
     }
   else if ((default_word_regexp && (isalpha (ch) || ch == '_'))
 #ifdef ENABLE_CHANGEWORD
-           || (! default_word_regexp && word_regexp.fastmap[ch])
+           || (! default_word_regexp && word_regexp->buf.fastmap[ch])
 #endif /* ENABLE_CHANGEWORD */
            )
     {
@@ -1141,7 +1934,8 @@ print_token (const char *s, token_type t, token_data *td)
       xfprintf (stderr, "eof\n");
       break;
     }
-  xfprintf (stderr, "\t\"%s\"\n", TOKEN_DATA_TEXT (td));
+  xfprintf (stderr, "\t\"%.*s\"\n", (int) TOKEN_DATA_LEN (td),
+            TOKEN_DATA_TEXT (td));
 }
 
 static void M4_GNUC_UNUSED
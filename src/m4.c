@@ -67,6 +67,30 @@ int warning_status = 0;
 /* Artificial limit for expansion_level in macro.c.  */
 int nesting_limit = 1024;
 
+/* Map large input files into memory rather than reading them.  */
+bool mmap_input = false;
+
+/* Limit on the memory used by diversions before spilling them to
+   temporary files, or 0 to base it on the available memory.  */
+size_t diversion_memory = 0;
+
+/* Number of spilled diversion files kept open, or 0 for the default.  */
+int diversion_files = 0;
+
+/* Spill diversions to anonymous files in memory rather than to
+   temporary files on disk.  */
+bool spill_to_memory = false;
+
+/* Compress diversions spilled to temporary files.  */
+bool compress_diversions = false;
+
+/* Write standard output from a separate thread.  */
+bool async_output = false;
+
+/* Size of the buffer for standard output when it is not a terminal,
+   or 0 to leave buffering to stdio.  */
+size_t output_buffer_size = DEFAULT_OUTPUT_BUFFER_SIZE;
+
 #ifdef ENABLE_CHANGEWORD
 /* User provided regexp for describing m4 words.  */
 const char *user_word_regexp = "";
@@ -202,6 +226,9 @@ Operation modes:\n\
                                warn if macro definition matches REGEXP,\n\
                                  default %s\n\
 ", DEFAULT_MACRO_SEQUENCE);
+      fputs ("\
+      --async-output           write standard output from another thread\n\
+", stdout);
 #ifdef ENABLE_CHANGEWORD
       fputs ("\
   -W, --word-regexp=REGEXP     use REGEXP for macro name syntax\n\
@@ -220,9 +247,19 @@ Preprocessor features:\n\
 Limits control:\n\
   -g, --gnu                    override -G to re-enable GNU extensions\n\
   -G, --traditional            suppress all GNU extensions\n\
-  -H, --hashsize=PRIME         set symbol lookup hash table size [509]\n\
+  -H, --hashsize=NUMBER        set initial symbol hash table size [509]\n\
   -L, --nesting-limit=NUMBER   change nesting limit, 0 for unlimited [%d]\n\
-"), nesting_limit);
+      --mmap-input             map large input files into memory\n\
+      --diversion-memory=SIZE  keep up to SIZE bytes of diversions in\n\
+                                 memory, with optional suffix k, M or G\n\
+      --diversion-files=NUMBER\n\
+                               keep up to NUMBER diversion files open [64]\n\
+      --spill-to-memory        move diversions over the limit to anonymous\n\
+                                 files in memory, not to temporary files\n\
+      --compress-diversions    compress diversions moved over the limit\n\
+      --output-buffer=SIZE     buffer SIZE bytes of output to a file or pipe,\n\
+                                 with optional suffix k, M or G [%luk]\n\
+"), nesting_limit, (unsigned long int) DEFAULT_OUTPUT_BUFFER_SIZE / 1024);
       puts ("");
       fputs ("\
 Frozen state files:\n\
@@ -252,6 +289,7 @@ FLAGS is any of:\n\
   t   trace for all macro calls, not only traceon'ed\n\
   x   add a unique macro call id, useful with c flag\n\
   V   shorthand for all of the above flags\n\
+  s   show internal statistics at exit\n\
 ", stdout);
       fputs ("\
 \n\
@@ -276,8 +314,15 @@ mismatch, or whatever value was passed to the m4exit macro.\n\
    non-character as a pseudo short option, starting with CHAR_MAX + 1.  */
 enum
 {
-  DEBUGFILE_OPTION = CHAR_MAX + 1,      /* no short opt */
+  ASYNC_OUTPUT_OPTION = CHAR_MAX + 1,   /* no short opt */
+  COMPRESS_DIVERSIONS_OPTION,           /* no short opt */
+  DEBUGFILE_OPTION,                     /* no short opt */
   DIVERSIONS_OPTION,                    /* not quite -N, because of message */
+  DIVERSION_FILES_OPTION,               /* no short opt */
+  DIVERSION_MEMORY_OPTION,              /* no short opt */
+  MMAP_INPUT_OPTION,                    /* no short opt */
+  OUTPUT_BUFFER_OPTION,                 /* no short opt */
+  SPILL_TO_MEMORY_OPTION,               /* no short opt */
   WARN_MACRO_SEQUENCE_OPTION,           /* no short opt */
 
   HELP_OPTION,                          /* no short opt */
@@ -307,8 +352,15 @@ static const struct option long_options[] =
   {"undefine", required_argument, NULL, 'U'},
   {"word-regexp", required_argument, NULL, 'W'},
 
+  {"async-output", no_argument, NULL, ASYNC_OUTPUT_OPTION},
+  {"compress-diversions", no_argument, NULL, COMPRESS_DIVERSIONS_OPTION},
   {"debugfile", optional_argument, NULL, DEBUGFILE_OPTION},
   {"diversions", required_argument, NULL, DIVERSIONS_OPTION},
+  {"diversion-files", required_argument, NULL, DIVERSION_FILES_OPTION},
+  {"diversion-memory", required_argument, NULL, DIVERSION_MEMORY_OPTION},
+  {"mmap-input", no_argument, NULL, MMAP_INPUT_OPTION},
+  {"output-buffer", required_argument, NULL, OUTPUT_BUFFER_OPTION},
+  {"spill-to-memory", no_argument, NULL, SPILL_TO_MEMORY_OPTION},
   {"warn-macro-sequence", optional_argument, NULL, WARN_MACRO_SEQUENCE_OPTION},
 
   {"help", no_argument, NULL, HELP_OPTION},
@@ -317,6 +369,40 @@ static const struct option long_options[] =
   { NULL, 0, NULL, 0 },
 };
 
+/* Parse the size ARG, a decimal number optionally followed by one of
+   the suffixes k, M or G (powers of 1024).  Return 0 if ARG is not a
+   valid, nonzero size.  */
+static size_t
+parse_size (const char *arg)
+{
+  char *end;
+  unsigned long int value;
+  size_t scale = 1;
+
+  errno = 0;
+  value = strtoul (arg, &end, 10);
+  if (end == arg || errno != 0 || !isdigit (to_uchar (*arg)))
+    return 0;
+  switch (*end)
+    {
+    case 'k': case 'K':
+      scale = 1024;
+      end++;
+      break;
+    case 'm': case 'M':
+      scale = 1024 * 1024;
+      end++;
+      break;
+    case 'g': case 'G':
+      scale = 1024 * 1024 * 1024;
+      end++;
+      break;
+    }
+  if (*end != '\0' || value > SIZE_MAX / scale)
+    return 0;
+  return value * scale;
+}
+
 /* Process a command line file NAME, and return true only if it was
    stdin.  */
 static void
@@ -378,6 +464,9 @@ main (int argc, char *const *argv)
 
   set_program_name (argv[0]);
   retcode = EXIT_SUCCESS;
+  /* Handlers run in reverse order, so the buffer of stdout is only
+     freed once close_stdin has closed it.  */
+  atexit (output_free_buffer);
   atexit (close_stdin);
 
   include_init ();
@@ -557,6 +646,43 @@ main (int argc, char *const *argv)
         debugfile = optarg;
         break;
 
+      case MMAP_INPUT_OPTION:
+        mmap_input = true;
+        break;
+
+      case SPILL_TO_MEMORY_OPTION:
+        spill_to_memory = true;
+        break;
+
+      case COMPRESS_DIVERSIONS_OPTION:
+        compress_diversions = true;
+        break;
+
+      case ASYNC_OUTPUT_OPTION:
+        async_output = true;
+        break;
+
+      case DIVERSION_FILES_OPTION:
+        diversion_files = strtol (optarg, NULL, 10);
+        if (diversion_files <= 0)
+          error (EXIT_FAILURE, 0,
+                 _("invalid number of diversion files: `%s'"), optarg);
+        break;
+
+      case DIVERSION_MEMORY_OPTION:
+        diversion_memory = parse_size (optarg);
+        if (diversion_memory == 0)
+          error (EXIT_FAILURE, 0, _("invalid diversion memory size: `%s'"),
+                 optarg);
+        break;
+
+      case OUTPUT_BUFFER_OPTION:
+        output_buffer_size = parse_size (optarg);
+        if (output_buffer_size == 0)
+          error (EXIT_FAILURE, 0, _("invalid output buffer size: `%s'"),
+                 optarg);
+        break;
+
       case WARN_MACRO_SEQUENCE_OPTION:
          /* Don't call set_macro_sequence here, as it can exit.
             --warn-macro-sequence sets optarg to NULL (which uses the
@@ -582,6 +708,11 @@ main (int argc, char *const *argv)
     M4ERROR ((warning_status, errno, "cannot set debug file `%s'", debugfile));
 
   input_init ();
+  if (interactive)
+    {
+      async_output = false;
+      output_buffer_size = 0;
+    }
   output_init ();
   symtab_init ();
   set_macro_sequence (macro_sequence);
@@ -617,7 +748,9 @@ main (int argc, char *const *argv)
             char *macro_value = strchr (macro_name, '=');
             if (macro_value)
               *macro_value++ = '\0';
-            define_user_macro (macro_name, macro_value, SYMBOL_INSERT);
+            define_user_macro (macro_name, macro_value,
+                               macro_value ? strlen (macro_value) : 0,
+                               SYMBOL_INSERT);
             free (macro_name);
           }
           break;
@@ -670,11 +803,6 @@ main (int argc, char *const *argv)
   while (pop_wrapup ())
     expand_input ();
 
-  /* Change debug stream back to stderr, to force flushing the debug
-     stream and detect any errors it might have encountered.  The
-     three standard streams are closed by close_stdin.  */
-  debug_set_output (NULL);
-
   if (frozen_file_to_write)
     produce_frozen_state (frozen_file_to_write);
   else
@@ -682,6 +810,20 @@ main (int argc, char *const *argv)
       make_diversion (0);
       undivert_all ();
     }
+
+  /* Statistics come last, so that they cover the diversions undiverted
+     at exit.  */
+  if (debug_level & DEBUG_TRACE_STATS)
+    {
+      show_lookup_stats ();
+      show_regex_stats ();
+      show_diversion_stats ();
+    }
+
+  /* Change debug stream back to stderr, to force flushing the debug
+     stream and detect any errors it might have encountered.  The
+     three standard streams are closed by close_stdin.  */
+  debug_set_output (NULL);
   output_exit ();
   free_macro_sequence ();
   exit (retcode);
@@ -44,6 +44,7 @@
 #include "exitfail.h"
 #include "filenamecat.h"
 #include "obstack.h"
+#include "regex.h"
 #include "stdio--.h"
 #include "stdlib--.h"
 #include "unistd--.h"
@@ -131,6 +132,13 @@ extern int max_debug_argument_length;   /* -l */
 extern int suppress_warnings;           /* -Q */
 extern int warning_status;              /* -E */
 extern int nesting_limit;               /* -L */
+extern bool mmap_input;                 /* --mmap-input */
+extern size_t diversion_memory;         /* --diversion-memory */
+extern int diversion_files;             /* --diversion-files */
+extern bool spill_to_memory;            /* --spill-to-memory */
+extern bool compress_diversions;        /* --compress-diversions */
+extern bool async_output;               /* --async-output */
+extern size_t output_buffer_size;       /* --output-buffer */
 #ifdef ENABLE_CHANGEWORD
 extern const char *user_word_regexp;    /* -W */
 #endif
@@ -173,6 +181,8 @@ extern FILE *debug;
 #define DEBUG_TRACE_INPUT 256
 /* x: add call id to trace output */
 #define DEBUG_TRACE_CALLID 512
+/* s: show internal statistics at exit -- not part of V */
+#define DEBUG_TRACE_STATS 1024
 
 /* V: very verbose --  print everything */
 #define DEBUG_TRACE_VERBOSE 1023
@@ -264,6 +274,53 @@ enum token_data_type
   TOKEN_FUNC
 };
 
+/* An allocation holding several shared_text, made by share_args ()
+   and freed once none of them is referenced.  */
+struct shared_block
+{
+  size_t live;                  /* number of them still referenced */
+};
+
+typedef struct shared_block shared_block;
+
+/* Argument text that outlives the macro call which collected it,
+   because $@, $* or shift referred to it instead of copying it into
+   the expansion; see refer_to_args ().  */
+struct shared_text
+{
+  size_t refs;                  /* number of references held */
+  int quote_age;                /* see argv_string_ok () in input.c */
+  size_t len;                   /* length of text */
+  char *text;                   /* NUL-terminated, allocated with it */
+  shared_block *block;          /* allocation holding it, or NULL */
+};
+
+typedef struct shared_text shared_text;
+
+/* A list of shared arguments, which reads back as their texts
+   separated by commas, each quoted by LQUOTE and RQUOTE.  */
+struct shared_args
+{
+  size_t refs;                  /* number of references held */
+  int argc;                     /* number of arguments */
+  shared_text **argv;           /* the arguments */
+  STRING lquote;                /* quotes when the list was made, */
+  STRING rquote;                /* or empty if unquoted */
+};
+
+typedef struct shared_args shared_args;
+
+/* A reference to a shared_args within the text of a token or an
+   argument: the LEN bytes at OFFSET are the text of ARGS.  */
+struct text_ref
+{
+  size_t offset;
+  size_t len;
+  shared_args *args;
+};
+
+typedef struct text_ref text_ref;
+
 struct token_data
 {
   enum token_data_type type;
@@ -271,7 +328,12 @@ struct token_data
     {
       struct
         {
-          char *text;
+          char *text;           /* NUL-terminated, except in tokens */
+          size_t len;           /* length of text */
+          shared_text *shared;  /* owner of text, if it is shared */
+          text_ref *refs;       /* shared_args within text, or NULL */
+          int nrefs;            /* number of REFS */
+          size_t hash;          /* hash_text () of text, for words */
 #ifdef ENABLE_CHANGEWORD
           char *original_text;
 #endif
@@ -284,6 +346,11 @@ struct token_data
 
 #define TOKEN_DATA_TYPE(Td)             ((Td)->type)
 #define TOKEN_DATA_TEXT(Td)             ((Td)->u.u_t.text)
+#define TOKEN_DATA_LEN(Td)              ((Td)->u.u_t.len)
+#define TOKEN_DATA_SHARED(Td)           ((Td)->u.u_t.shared)
+#define TOKEN_DATA_REFS(Td)             ((Td)->u.u_t.refs)
+#define TOKEN_DATA_NREFS(Td)            ((Td)->u.u_t.nrefs)
+#define TOKEN_DATA_HASH(Td)             ((Td)->u.u_t.hash)
 #ifdef ENABLE_CHANGEWORD
 # define TOKEN_DATA_ORIG_TEXT(Td)       ((Td)->u.u_t.original_text)
 #endif
@@ -302,8 +369,13 @@ void push_file (FILE *, const char *, bool);
 void push_macro (builtin_func *);
 struct obstack *push_string_init (void);
 const char *push_string_finish (void);
-void push_wrapup (const char *);
+bool refer_to_args (struct obstack *, int, token_data **, bool);
+void append_arg_text (struct obstack *, token_data *);
+shared_text *next_argv_arg (void);
+bool read_argv_text (struct obstack *);
+void push_wrapup (const char *, size_t);
 bool pop_wrapup (void);
+void sync_input_files (void);
 
 /* current input file, and line */
 extern const char *current_file;
@@ -328,14 +400,19 @@ void set_word_regexp (const char *);
 extern int current_diversion;
 extern int output_current_line;
 
+#define DEFAULT_OUTPUT_BUFFER_SIZE (256 * 1024) /* for --output-buffer */
+
 void output_init (void);
 void output_exit (void);
+void output_free_buffer (void);
+void output_flush (void);
 void output_text (const char *, int);
 void shipout_text (struct obstack *, const char *, int, int);
 void make_diversion (int);
 void insert_diversion (int);
 void insert_file (FILE *);
 void freeze_diversions (FILE *);
+void show_diversion_stats (void);
 
 /* File symtab.c  --- symbol table definitions.  */
 
@@ -349,10 +426,32 @@ enum symbol_lookup
   SYMBOL_POPDEF
 };
 
+/* The definition of a user macro is compiled once, when it is
+   defined, into a list of pieces.  Each piece is LEN bytes of literal
+   text starting at OFFSET in the definition, followed by the parameter
+   reference PARAM: an argument number, or one of the values below.
+   The last piece of the list always has PARAM_NONE.  */
+enum macro_param
+{
+  PARAM_NONE = -1,              /* end of the definition */
+  PARAM_ARGC = -2,              /* $# */
+  PARAM_STAR = -3,              /* $* */
+  PARAM_AT = -4                 /* $@ */
+};
+
+struct macro_piece
+{
+  size_t offset;
+  size_t len;
+  int param;
+};
+
+typedef struct macro_piece macro_piece;
+
 /* Symbol table entry.  */
 struct symbol
 {
-  struct symbol *next;
+  struct symbol *next;          /* older definition of the same name */
   bool_bitfield traced : 1;
   bool_bitfield shadowed : 1;
   bool_bitfield macro_args : 1;
@@ -360,8 +459,9 @@ struct symbol
   bool_bitfield deleted : 1;
   int pending_expansions;
 
-  char *name;
+  shared_text *name;            /* shared by all definitions */
   token_data data;
+  macro_piece *pieces;          /* NULL if no parameter references */
 };
 
 #define SYMBOL_NEXT(S)          ((S)->next)
@@ -371,28 +471,44 @@ struct symbol
 #define SYMBOL_BLIND_NO_ARGS(S) ((S)->blind_no_args)
 #define SYMBOL_DELETED(S)       ((S)->deleted)
 #define SYMBOL_PENDING_EXPANSIONS(S) ((S)->pending_expansions)
-#define SYMBOL_NAME(S)          ((S)->name)
+#define SYMBOL_NAME(S)          ((S)->name->text)
+#define SYMBOL_NAME_LEN(S)      ((S)->name->len)
 #define SYMBOL_TYPE(S)          (TOKEN_DATA_TYPE (&(S)->data))
 #define SYMBOL_TEXT(S)          (TOKEN_DATA_TEXT (&(S)->data))
+#define SYMBOL_TEXT_LEN(S)      (TOKEN_DATA_LEN (&(S)->data))
 #define SYMBOL_FUNC(S)          (TOKEN_DATA_FUNC (&(S)->data))
+#define SYMBOL_PIECES(S)        ((S)->pieces)
 
 typedef enum symbol_lookup symbol_lookup;
 typedef struct symbol symbol;
 typedef void hack_symbol (symbol *, void *);
 
-#define HASHMAX 509             /* default, overridden by -Hsize */
+#define HASHMAX 509             /* initial size, overridden by -Hsize */
 
-extern symbol **symtab;
+/* Changed whenever a name is added to or removed from the table.  */
+extern unsigned long symtab_generation;
 
 void free_symbol (symbol *sym);
 void symtab_init (void);
+size_t hash_words (size_t, const char *, size_t);
+size_t hash_finish (size_t, const char *, size_t, size_t);
+size_t hash_text (const char *, size_t, size_t);
 symbol *lookup_symbol (const char *, symbol_lookup);
+symbol *lookup_hashed_symbol (const char *, size_t, size_t, symbol_lookup);
 void hack_all_symbols (hack_symbol *, void *);
 
 /* File: macro.c  --- macro expansion.  */
 
+extern bool expansion_traced;
+
 void expand_input (void);
+void show_lookup_stats (void);
 void call_macro (symbol *, int, token_data **, struct obstack *);
+shared_text *make_shared_text (const char *, size_t);
+void share_args (int, token_data **);
+void release_shared_text (shared_text *);
+void release_shared_args (shared_args *);
+void release_arg (token_data *);
 
 /* File: builtin.c  --- builtins.  */
 
@@ -412,10 +528,22 @@ struct predefined
   const char *func;
 };
 
+/* A compiled regular expression, shared through a cache by the
+   builtins regexp and patsubst, changeword and --warn-macro-sequence.  */
+struct pattern_buffer
+{
+  struct re_pattern_buffer buf; /* compiled regular expression */
+  struct re_registers regs;     /* for subexpression matches */
+  char *str;                    /* text of the regular expression */
+  size_t len;                   /* length of str */
+  reg_syntax_t syntax;          /* re_syntax_options when compiled */
+  unsigned int refs;            /* users, counting the cache */
+  bool literal;                 /* str only matches itself */
+};
+
 typedef struct builtin builtin;
 typedef struct predefined predefined;
-struct re_pattern_buffer;
-struct re_registers;
+typedef struct pattern_buffer pattern_buffer;
 
 /* The default sequence detects multi-digit parameters (obsolete after
    1.4.x), and any use of extended arguments with the default ${}
@@ -426,11 +554,14 @@ void builtin_init (void);
 void define_builtin (const char *, const builtin *, symbol_lookup);
 void set_macro_sequence (const char *);
 void free_macro_sequence (void);
-void define_user_macro (const char *, const char *, symbol_lookup);
+void define_user_macro (const char *, const char *, size_t, symbol_lookup);
 void undivert_all (void);
 void expand_user_macro (struct obstack *, symbol *, int, token_data **);
 void m4_placeholder (struct obstack *, int, token_data **);
 void init_pattern_buffer (struct re_pattern_buffer *, struct re_registers *);
+pattern_buffer *compile_pattern (const char *, size_t, const char **);
+void free_pattern (pattern_buffer *);
+void show_regex_stats (void);
 const char *ntoa (int32_t, int);
 
 const builtin *find_builtin_by_addr (builtin_func *);
@@ -445,7 +576,7 @@ FILE *m4_path_search (const char *, char **);
 
 /* File: eval.c  --- expression evaluation.  */
 
-bool evaluate (const char *, int32_t *);
+bool evaluate (const char *, size_t, int32_t *);
 
 /* File: format.c  --- printf like formatting.  */
 
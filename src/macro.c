@@ -33,6 +33,10 @@ int expansion_level = 0;
 /* The number of the current call of expand_macro ().  */
 static int macro_call_id = 0;
 
+/* True while calling a macro whose expansion will be traced, and so
+   must be built as plain text.  */
+bool expansion_traced = false;
+
 /* The shared stack of collected arguments for macro calls; as each
    argument is collected, it is finished and its location stored in
    argv_stack.  Normally, this stack can be used simultaneously by
@@ -50,6 +54,29 @@ static struct obstack argc_stack;
    size again.  */
 static struct obstack argv_stack;
 
+/* A small direct mapped cache of the symbol table lookups done for
+   words in the input, so that the words seen over and over again, such
+   as dnl, define or ifelse, are resolved with a single comparison.
+   Words that are not macro names are cached too, with a NULL SYM.  An
+   entry is only valid while its GENERATION matches symtab_generation,
+   and words longer than LOOKUP_CACHE_WORD bytes are never cached.  */
+#define LOOKUP_CACHE_SIZE 256
+#define LOOKUP_CACHE_WORD 32
+
+struct lookup_cache_entry
+{
+  unsigned long generation;
+  size_t len;
+  symbol *sym;
+  char word[LOOKUP_CACHE_WORD];
+};
+
+static struct lookup_cache_entry lookup_cache[LOOKUP_CACHE_SIZE];
+
+/* Number of word lookups answered by, and missed by, the cache.  */
+static unsigned long lookup_cache_hits;
+static unsigned long lookup_cache_misses;
+
 /*----------------------------------------------------------------------.
 | This function read all input, and expands each token, one at a time.  |
 `----------------------------------------------------------------------*/
@@ -72,6 +99,49 @@ expand_input (void)
 }
 
 
+/*-------------------------------------------------------------------.
+| Look up the word WORD of length LEN and hash value H, as computed  |
+| by the lexer, in the symbol table, going through the lookup cache. |
+`-------------------------------------------------------------------*/
+
+static symbol *
+lookup_word (const char *word, size_t len, size_t h)
+{
+  struct lookup_cache_entry *entry;
+
+  if (len > LOOKUP_CACHE_WORD)
+    {
+      lookup_cache_misses++;
+      return lookup_hashed_symbol (word, len, h, SYMBOL_LOOKUP);
+    }
+
+  entry = &lookup_cache[h % LOOKUP_CACHE_SIZE];
+  if (entry->generation == symtab_generation && entry->len == len
+      && memcmp (entry->word, word, len) == 0)
+    {
+      lookup_cache_hits++;
+      return entry->sym;
+    }
+
+  lookup_cache_misses++;
+  entry->generation = symtab_generation;
+  entry->len = len;
+  entry->sym = lookup_hashed_symbol (word, len, h, SYMBOL_LOOKUP);
+  memcpy (entry->word, word, len);
+  return entry->sym;
+}
+
+/*------------------------------------------------------------------.
+| Print the statistics of the lookup cache, for the `s' debug flag. |
+`------------------------------------------------------------------*/
+
+void
+show_lookup_stats (void)
+{
+  DEBUG_MESSAGE2 ("symbol lookup cache: %lu hits, %lu misses",
+                  lookup_cache_hits, lookup_cache_misses);
+}
+
 /*----------------------------------------------------------------.
 | Expand one token, according to its type.  Potential macro names |
 | (TOKEN_WORD) are looked up in the symbol table, to see if they  |
@@ -95,12 +165,12 @@ expand_token (struct obstack *obs, token_type t, token_data *td, int line)
     case TOKEN_CLOSE:
     case TOKEN_SIMPLE:
     case TOKEN_STRING:
-      shipout_text (obs, TOKEN_DATA_TEXT (td), strlen (TOKEN_DATA_TEXT (td)),
-                    line);
+      shipout_text (obs, TOKEN_DATA_TEXT (td), TOKEN_DATA_LEN (td), line);
       break;
 
     case TOKEN_WORD:
-      sym = lookup_symbol (TOKEN_DATA_TEXT (td), SYMBOL_LOOKUP);
+      sym = lookup_word (TOKEN_DATA_TEXT (td), TOKEN_DATA_LEN (td),
+                         TOKEN_DATA_HASH (td));
       if (sym == NULL || SYMBOL_TYPE (sym) == TOKEN_VOID
           || (SYMBOL_TYPE (sym) == TOKEN_FUNC
               && SYMBOL_BLIND_NO_ARGS (sym)
@@ -110,8 +180,8 @@ expand_token (struct obstack *obs, token_type t, token_data *td, int line)
           shipout_text (obs, TOKEN_DATA_ORIG_TEXT (td),
                         strlen (TOKEN_DATA_ORIG_TEXT (td)), line);
 #else
-          shipout_text (obs, TOKEN_DATA_TEXT (td),
-                        strlen (TOKEN_DATA_TEXT (td)), line);
+          shipout_text (obs, TOKEN_DATA_TEXT (td), TOKEN_DATA_LEN (td),
+                        line);
 #endif
         }
       else
@@ -126,6 +196,131 @@ expand_token (struct obstack *obs, token_type t, token_data *td, int line)
 }
 
 
+/*------------------------------------------------------------------.
+| Return a new shared_text holding a copy of the LEN bytes at TEXT, |
+| with a single reference.                                          |
+`------------------------------------------------------------------*/
+
+shared_text *
+make_shared_text (const char *text, size_t len)
+{
+  shared_text *st = (shared_text *) xmalloc (sizeof *st + len + 1);
+
+  st->refs = 1;
+  st->quote_age = 0;
+  st->len = len;
+  st->text = (char *) (st + 1);
+  st->block = NULL;
+  memcpy (st->text, text, len);
+  st->text[len] = '\0';
+  return st;
+}
+
+/*-------------------------------------------------------------------.
+| Give each of the arguments 1 to ARGC - 1 of ARGV whose text is not |
+| shared yet a shared_text holding a copy of it, with one reference  |
+| that ARGV keeps until the end of the call.  These are allocated    |
+| together, since a long list of short arguments would otherwise     |
+| cost an allocation each.                                           |
+`-------------------------------------------------------------------*/
+
+void
+share_args (int argc, token_data **argv)
+{
+  shared_block *block;
+  shared_text *st;
+  char *text;
+  size_t count = 0;
+  size_t bytes = 0;
+  int i;
+
+  for (i = 1; i < argc; i++)
+    if (TOKEN_DATA_SHARED (argv[i]) == NULL)
+      {
+        count++;
+        bytes += TOKEN_DATA_LEN (argv[i]) + 1;
+      }
+  if (count == 0)
+    return;
+
+  block = (shared_block *) xmalloc (sizeof *block + count * sizeof *st
+                                    + bytes);
+  block->live = count;
+  st = (shared_text *) (block + 1);
+  text = (char *) (st + count);
+  for (i = 1; i < argc; i++)
+    if (TOKEN_DATA_SHARED (argv[i]) == NULL)
+      {
+        size_t len = TOKEN_DATA_LEN (argv[i]);
+
+        st->refs = 1;
+        st->quote_age = 0;
+        st->len = len;
+        st->text = text;
+        st->block = block;
+        memcpy (text, TOKEN_DATA_TEXT (argv[i]), len);
+        text[len] = '\0';
+        TOKEN_DATA_TEXT (argv[i]) = text;
+        TOKEN_DATA_SHARED (argv[i]) = st;
+        text += len + 1;
+        st++;
+      }
+}
+
+/*----------------------------------------------------------------.
+| Drop a reference to ST, freeing it when the last one is gone.   |
+`----------------------------------------------------------------*/
+
+void
+release_shared_text (shared_text *st)
+{
+  if (--st->refs > 0)
+    return;
+  if (st->block == NULL)
+    free (st);
+  else if (--st->block->live == 0)
+    free (st->block);
+}
+
+/*----------------------------------------------------------------.
+| Drop a reference to SA, freeing it and releasing its arguments  |
+| when the last one is gone.                                      |
+`----------------------------------------------------------------*/
+
+void
+release_shared_args (shared_args *sa)
+{
+  int i;
+
+  if (--sa->refs > 0)
+    return;
+  for (i = 0; i < sa->argc; i++)
+    release_shared_text (sa->argv[i]);
+  free (sa->argv);
+  free (sa->lquote.string);
+  free (sa->rquote.string);
+  free (sa);
+}
+
+/*----------------------------------------------------------------.
+| Release whatever shared text the argument ARG holds at the end  |
+| of a macro call.                                                |
+`----------------------------------------------------------------*/
+
+void
+release_arg (token_data *arg)
+{
+  int i;
+
+  if (TOKEN_DATA_TYPE (arg) != TOKEN_TEXT)
+    return;
+  if (TOKEN_DATA_SHARED (arg) != NULL)
+    release_shared_text (TOKEN_DATA_SHARED (arg));
+  for (i = 0; i < TOKEN_DATA_NREFS (arg); i++)
+    release_shared_args (TOKEN_DATA_REFS (arg)[i].args);
+  free (TOKEN_DATA_REFS (arg));
+}
+
 /*-------------------------------------------------------------------.
 | This function parses one argument to a macro call.  It expects the |
 | first left parenthesis, or the separating comma, to have been read |
@@ -134,6 +329,10 @@ expand_token (struct obstack *obs, token_type t, token_data *td, int line)
 | level of parentheses.  It returns a flag indicating whether the    |
 | argument read is the last for the active macro call.  The argument |
 | is built on the obstack OBS, indirectly through expand_token ().   |
+| An argument consisting of nothing but a shared string token, as    |
+| produced by rescanning $@ or shift, shares that text instead.      |
+| References to argument lists found within string tokens are kept   |
+| with the argument, so that append_arg_text () can pass them on.    |
 `-------------------------------------------------------------------*/
 
 static bool
@@ -142,12 +341,32 @@ expand_argument (struct obstack *obs, token_data *argp)
   token_type t;
   token_data td;
   char *text;
+  size_t len;
   int paren_level;
   const char *file = current_file;
   int line = current_line;
+  shared_text *shared = NULL;   /* whole argument so far, if shared */
+  text_ref *refs = NULL;        /* argument lists within the text */
+  int nrefs = 0;
+  size_t refs_alloc = 0;
+  int i;
 
   TOKEN_DATA_TYPE (argp) = TOKEN_VOID;
 
+  /* Most arguments read back from $@ or shift need no tokens.  */
+  shared = next_argv_arg ();
+  if (shared != NULL)
+    {
+      shared->refs++;
+      TOKEN_DATA_TYPE (argp) = TOKEN_TEXT;
+      TOKEN_DATA_TEXT (argp) = shared->text;
+      TOKEN_DATA_LEN (argp) = shared->len;
+      TOKEN_DATA_SHARED (argp) = shared;
+      TOKEN_DATA_REFS (argp) = NULL;
+      TOKEN_DATA_NREFS (argp) = 0;
+      return true;
+    }
+
   /* Skip leading white space.  */
   do
     {
@@ -159,6 +378,15 @@ expand_argument (struct obstack *obs, token_data *argp)
 
   while (1)
     {
+      /* Anything but the end of the argument means the shared text
+         is only a prefix, to be copied after all.  */
+      if (shared != NULL
+          && !((t == TOKEN_COMMA || t == TOKEN_CLOSE) && paren_level == 0))
+        {
+          obstack_grow (obs, shared->text, shared->len);
+          release_shared_text (shared);
+          shared = NULL;
+        }
 
       switch (t)
         { /* TOKSW */
@@ -167,6 +395,7 @@ expand_argument (struct obstack *obs, token_data *argp)
           if (paren_level == 0)
             {
               /* The argument MUST be finished, whether we want it or not.  */
+              len = obstack_object_size (obs);
               obstack_1grow (obs, '\0');
               text = (char *) obstack_finish (obs);
 
@@ -174,6 +403,21 @@ expand_argument (struct obstack *obs, token_data *argp)
                 {
                   TOKEN_DATA_TYPE (argp) = TOKEN_TEXT;
                   TOKEN_DATA_TEXT (argp) = text;
+                  TOKEN_DATA_LEN (argp) = len;
+                  TOKEN_DATA_SHARED (argp) = shared;
+                  if (shared != NULL)
+                    {
+                      TOKEN_DATA_TEXT (argp) = shared->text;
+                      TOKEN_DATA_LEN (argp) = shared->len;
+                    }
+                  TOKEN_DATA_REFS (argp) = refs;
+                  TOKEN_DATA_NREFS (argp) = nrefs;
+                }
+              else
+                {
+                  for (i = 0; i < nrefs; i++)
+                    release_shared_args (refs[i].args);
+                  free (refs);
                 }
               return t == TOKEN_COMMA;
             }
@@ -196,8 +440,29 @@ expand_argument (struct obstack *obs, token_data *argp)
                             "ERROR: end of file in argument list"));
           break;
 
-        case TOKEN_WORD:
         case TOKEN_STRING:
+          /* The shared text must be referenced now, since reading the
+             next token may pop the input block holding it.  */
+          if (TOKEN_DATA_SHARED (&td) != NULL
+              && TOKEN_DATA_TYPE (argp) == TOKEN_VOID
+              && obstack_object_size (obs) == 0)
+            {
+              shared = TOKEN_DATA_SHARED (&td);
+              shared->refs++;
+              break;
+            }
+          for (i = 0; i < TOKEN_DATA_NREFS (&td); i++)
+            {
+              if ((size_t) nrefs == refs_alloc)
+                refs = (text_ref *) x2nrealloc (refs, &refs_alloc,
+                                                sizeof *refs);
+              refs[nrefs] = TOKEN_DATA_REFS (&td)[i];
+              refs[nrefs].offset += obstack_object_size (obs);
+              refs[nrefs].args->refs++;
+              nrefs++;
+            }
+          /* fallthru */
+        case TOKEN_WORD:
           expand_token (obs, t, &td, line);
           break;
 
@@ -215,6 +480,10 @@ expand_argument (struct obstack *obs, token_data *argp)
           abort ();
         }
 
+      /* Within parentheses, a list read back from shift is copied
+         whole.  */
+      if (paren_level > 0)
+        read_argv_text (obs);
       t = next_token (&td, NULL);
     }
 }
@@ -236,6 +505,10 @@ collect_arguments (symbol *sym, struct obstack *argptr,
 
   TOKEN_DATA_TYPE (&td) = TOKEN_TEXT;
   TOKEN_DATA_TEXT (&td) = SYMBOL_NAME (sym);
+  TOKEN_DATA_LEN (&td) = strlen (SYMBOL_NAME (sym));
+  TOKEN_DATA_SHARED (&td) = NULL;
+  TOKEN_DATA_REFS (&td) = NULL;
+  TOKEN_DATA_NREFS (&td) = 0;
   tdp = (token_data *) obstack_copy (arguments, &td, sizeof td);
   obstack_ptr_grow (argptr, tdp);
 
@@ -250,6 +523,10 @@ collect_arguments (symbol *sym, struct obstack *argptr,
             {
               TOKEN_DATA_TYPE (&td) = TOKEN_TEXT;
               TOKEN_DATA_TEXT (&td) = (char *) "";
+              TOKEN_DATA_LEN (&td) = 0;
+              TOKEN_DATA_SHARED (&td) = NULL;
+              TOKEN_DATA_REFS (&td) = NULL;
+              TOKEN_DATA_NREFS (&td) = 0;
             }
           tdp = (token_data *) obstack_copy (arguments, &td, sizeof td);
           obstack_ptr_grow (argptr, tdp);
@@ -314,7 +591,9 @@ expand_macro (symbol *sym)
   struct obstack *expansion;
   const char *expanded;
   bool traced;
+  bool was_traced;
   int my_call_id;
+  int i;
 
   /* Report errors at the location where the open parenthesis (if any)
      was found, but after expansion, restore global state back to the
@@ -368,7 +647,10 @@ expand_macro (symbol *sym)
     trace_pre (SYMBOL_NAME (sym), my_call_id, argc, argv);
 
   expansion = push_string_init ();
+  was_traced = expansion_traced;
+  expansion_traced = traced && (debug_level & DEBUG_TRACE_EXPANSION);
   call_macro (sym, argc, argv, expansion);
+  expansion_traced = was_traced;
   expanded = push_string_finish ();
 
   if (traced)
@@ -383,6 +665,8 @@ expand_macro (symbol *sym)
   if (SYMBOL_DELETED (sym))
     free_symbol (sym);
 
+  for (i = 1; i < argc; i++)
+    release_arg (argv[i]);
   if (use_argc_stack)
     obstack_free (&argc_stack, argv[0]);
   else
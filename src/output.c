@@ -22,20 +22,92 @@
 
 #include <limits.h>
 #include <sys/stat.h>
+#if HAVE_SETRLIMIT
+# include <sys/resource.h>
+#endif
+#if HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#if USE_POSIX_THREADS
+# include <pthread.h>
+# include <signal.h>
+#endif
+#if UNIX
+# include <sys/uio.h>
+#endif
+
+/* Linux can copy between two descriptors without a trip through user
+   space: sendfile from a regular file to anything, and, since glibc
+   2.27, copy_file_range between regular files, which may share the
+   underlying storage instead of copying it.  */
+#ifdef __linux__
+# include <sys/sendfile.h>
+# define KERNEL_COPY 1
+# if defined __GLIBC__ \
+  && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#  define KERNEL_COPY_FILE_RANGE 1
+# endif
+#endif
+
+/* Linux can also create anonymous files in memory, which spilled
+   diversions can use instead of temporary files on disk.  */
+#if defined __linux__ && defined MFD_CLOEXEC
+# include "unistd-safer.h"
+# define MEMFD_SPILL 1
+#endif
+
+/* The GNU C library can make a stream out of functions of our own,
+   which lets spilled diversions be compressed as they are written.  */
+#if defined __GLIBC__
+# define COMPRESS_SPILL 1
+#endif
 
 #include "gl_avltree_oset.h"
 #include "gl_xoset.h"
+#include "intprops.h"
 
-/* Size of initial in-memory buffer size for diversions.  Small diversions
-   would usually fit in.  */
+/* Size of the first chunk of an in-memory diversion.  Small diversions
+   would usually fit in.  Each further chunk is twice as big as the
+   previous one, up to MAXIMUM_CHUNK_SIZE, unless more is needed at
+   once.  */
 #define INITIAL_BUFFER_SIZE 512
+#define MAXIMUM_CHUNK_SIZE (64 * 1024)
 
-/* Maximum value for the total of all in-memory buffer sizes for
-   diversions.  */
-#define MAXIMUM_TOTAL_SIZE (512 * 1024)
+/* Number of chunks handed to a single writev call.  */
+#define CHUNK_IOV_COUNT 64
 
-/* Size of buffer size to use while copying files.  */
+/* Smallest default value for the total of all in-memory buffer sizes
+   for diversions.  Unless --diversion-memory says otherwise, the
+   limit is an eighth of the memory available at startup, but never
+   less than this.  */
+#define MINIMUM_TOTAL_SIZE (512 * 1024)
+
+/* Size of buffer size to use while copying files.  The buffer grows
+   to hold larger files in one piece, up to MAXIMUM_COPY_BUFFER_SIZE.  */
 #define COPY_BUFFER_SIZE (32 * 512)
+#define MAXIMUM_COPY_BUFFER_SIZE (1024 * 1024)
+
+/* Largest single request to the kernel when copying files.  */
+#define KERNEL_COPY_SIZE (1024 * 1024 * 1024)
+
+/* Number of spilled diversion files kept open, unless --diversion-files
+   says otherwise.  At most half of the file descriptors are used for
+   this, and at least two files are always kept.  */
+#define DEFAULT_TMP_CACHE_SIZE 64
+#define MINIMUM_TMP_CACHE_SIZE 2
+
+/* Size and number of the buffers for --async-output.  */
+#define ASYNC_BUFFER_SIZE (64 * 1024)
+#define ASYNC_BUFFER_COUNT 16
+
+/* With --compress-diversions, spilled diversions are written as
+   blocks of up to SPILL_BLOCK_SIZE bytes, each compressed on its own.
+   A block never grows by more than LZ_BOUND when compressed, and the
+   compressor finds matches through a hash table of 2^LZ_HASH_BITS
+   entries.  */
+#define SPILL_BLOCK_SIZE (64 * 1024)
+#define LZ_BOUND(Size) ((Size) + (Size) / 255 + 16)
+#define LZ_HASH_BITS 14
 
 /* Output functions.  Most of the complexity is for handling cpp like
    sync lines.
@@ -45,26 +117,61 @@
 
 typedef struct temp_dir m4_temp_dir;
 
+/* The text of an in-memory diversion is kept in a list of chunks, so
+   that it never has to be moved as the diversion grows, and so that
+   undiverting it into another in-memory diversion merely links the
+   lists together.  Every chunk but the last may have unused room.  */
+
+typedef struct diversion_chunk diversion_chunk;
+
+struct diversion_chunk
+  {
+    diversion_chunk *next;      /* Next chunk of the diversion.  */
+    size_t size;                /* Allocated size of text.  */
+    size_t used;                /* Bytes of text in use.  */
+    char *text;                 /* Follows the struct.  */
+  };
+
 /* When part of diversion_table, each struct m4_diversion either
    represents an open file (zero size, non-NULL u.file), an in-memory
-   buffer (non-zero size, non-NULL u.buffer), or an unused placeholder
-   diversion (zero size, u is NULL, non-zero used indicates that a
-   file has been created).  When not part of diversion_table, u.next
-   is a pointer to the free_list chain.  */
+   list of chunks (non-zero size, non-NULL u.chunks), or an unused
+   placeholder diversion (zero size, u is NULL, non-zero used indicates
+   that a file has been created).  When not part of diversion_table,
+   u.next is a pointer to the free_list chain.  */
 
 typedef struct m4_diversion m4_diversion;
 
+/* Statistics for the `s' debug flag, kept for every diversion number
+   that was ever used, even once the diversion itself is reclaimed.  */
+
+typedef struct diversion_stats diversion_stats;
+
+struct diversion_stats
+  {
+    int divnum;                 /* Which diversion this describes.  */
+    size_t peak_size;           /* Largest total size of its chunks.  */
+    unsigned long long undiverted; /* Bytes copied out by undivert.  */
+    unsigned long undiverts;    /* Times it was undiverted.  */
+    unsigned long spills;       /* Times it was moved to a file.  */
+    const char *spill_file;     /* Input location of the first spill.  */
+    int spill_line;
+    unsigned long opens;        /* Temporary files opened for it.  */
+    unsigned long closes;       /* Temporary files closed for it.  */
+  };
+
 struct m4_diversion
   {
     union
       {
         FILE *file;             /* Diversion file on disk.  */
-        char *buffer;           /* Malloc'd diversion buffer.  */
+        diversion_chunk *chunks; /* Malloc'd diversion chunks.  */
         m4_diversion *next;     /* Free-list pointer */
       } u;
+    diversion_chunk *tail;      /* Last of u.chunks.  */
     int divnum;                 /* Which diversion this represents.  */
-    int size;                   /* Usable size before reallocation.  */
-    int used;                   /* Used buffer length, or tmp file exists.  */
+    size_t size;                /* Total size of all chunks.  */
+    size_t used;                /* Used chunk length, or tmp file exists.  */
+    diversion_stats *stats;     /* Statistics for divnum, or NULL.  */
   };
 
 /* Table of diversions 1 through INT_MAX.  */
@@ -80,7 +187,21 @@ static m4_diversion *free_list;
 static struct obstack diversion_storage;
 
 /* Total size of all in-memory buffer sizes.  */
-static int total_buffer_size;
+static size_t total_buffer_size;
+
+/* Maximum value for total_buffer_size, before the largest in-memory
+   diversion is spilled to a temporary file.  */
+static size_t maximum_total_size;
+
+/* Statistics for the `s' debug flag: the largest total_buffer_size
+   seen, the number of diversions spilled to temporary files, and the
+   number of bytes they held at that point.  */
+static size_t peak_buffer_size;
+static unsigned long spill_count;
+static unsigned long long spill_bytes;
+
+/* Table of the diversion_stats of diversions 1 through INT_MAX.  */
+static gl_oset_t diversion_stats_table;
 
 /* The number of the currently active diversion.  This variable is
    maintained for the `divnum' builtin function.  */
@@ -89,8 +210,8 @@ int current_diversion;
 /* Current output diversion, NULL if output is being currently
    discarded.  output_diversion->u is guaranteed non-NULL except when
    the diversion has never been used; use size to determine if it is a
-   malloc'd buffer or a FILE.  output_diversion->used is 0 if u.file
-   is stdout, and non-zero if this is a malloc'd buffer or a temporary
+   list of chunks or a FILE.  output_diversion->used is 0 if u.file
+   is stdout, and non-zero if this is a list of chunks or a temporary
    diversion file.  */
 static m4_diversion *output_diversion;
 
@@ -98,13 +219,14 @@ static m4_diversion *output_diversion;
    output_diversion->size is 0.  */
 static FILE *output_file;
 
-/* Cache of output_diversion->u.buffer + output_diversion->used, only
-   valid when output_diversion->size is non-zero.  */
+/* Where the next byte goes in output_diversion->tail, only valid when
+   output_diversion->size is non-zero.  The bytes written here are only
+   accounted for in the used counts by sync_output_chunk ().  */
 static char *output_cursor;
 
-/* Cache of output_diversion->size - output_diversion->used, only
+/* Room left after output_cursor in output_diversion->tail, only
    valid when output_diversion->size is non-zero.  */
-static int output_unused;
+static size_t output_unused;
 
 /* Number of input line we are generating output for.  */
 int output_current_line;
@@ -112,16 +234,117 @@ int output_current_line;
 /* Temporary directory holding all spilled diversion files.  */
 static m4_temp_dir *output_temp_dir;
 
-/* Cache of most recently used spilled diversion files.  */
-static FILE *tmp_file1;
-static FILE *tmp_file2;
+/* The buffer of standard output, if output_init replaced the stdio
+   one.  It is in use until close_stdin closes stdout at exit.  */
+static char *stdout_buffer;
+
+/* Cache of spilled diversion files that are kept open, so that
+   switching back to a diversion needs no reopening.  The entries are
+   kept with the most recently used first, and the last one that can
+   be reopened is closed to make room for another.  A file on disk
+   leaves the cache while m4_tmpopen hands it out, until m4_tmpclose;
+   a file in memory has no name to reopen it by, so it stays in the
+   cache until m4_tmpremove.  */
+
+typedef struct tmp_cache_entry tmp_cache_entry;
+
+struct tmp_cache_entry
+  {
+    FILE *file;                 /* Open diversion file.  */
+    int owner;                  /* Diversion that owns file.  */
+    bool memory;                /* True if file is a memfd.  */
+  };
+
+static tmp_cache_entry *tmp_cache;
+
+/* Number of entries allocated and in use in tmp_cache.  */
+static int tmp_cache_size;
+static int tmp_cache_count;
+
+/* Number of entries in tmp_cache that are files in memory.  It stays
+   below tmp_cache_size, so that a file on disk can always be closed
+   to make room; further diversions spill to disk instead.  */
+static int tmp_memory_count;
+
+/* Statistics for the `s' debug flag: how often m4_tmpopen found a
+   file already open, and how often it had to open it again.  */
+static unsigned long tmp_cache_hits;
+static unsigned long tmp_cache_misses;
+
+#ifdef COMPRESS_SPILL
+
+/* A spilled diversion compressed with --compress-diversions is read
+   and written through a stream of its own, whose cookie is a struct
+   spill_stream.  The file beneath holds a sequence of blocks, each
+   made of a struct spill_header followed by the stored bytes.  Such a
+   stream is written at its end, and the first read after writing
+   starts over from the first block, which is all that diversions
+   need; it cannot be repositioned otherwise, since the replacements
+   of fseeko and fflush in gnulib assume a file descriptor.  */
+
+typedef struct spill_stream spill_stream;
+typedef struct spill_header spill_header;
+
+struct spill_stream
+  {
+    FILE *file;                 /* Temporary file holding the blocks.  */
+    bool memory;                /* True if file is a memfd.  */
+    off_t size;                 /* Uncompressed size of all blocks.  */
+    off_t position;             /* Uncompressed offset while reading.  */
+    bool reading;               /* True once read since last written.  */
+    char *block;                /* Uncompressed block being read.  */
+    size_t block_used;          /* Bytes of text in block.  */
+    size_t block_read;          /* Bytes of block already read.  */
+    char buffer[SPILL_BLOCK_SIZE]; /* Stdio buffer of the stream.  */
+  };
+
+struct spill_header
+  {
+    uint32_t size;              /* Uncompressed size of the block.  */
+    uint32_t stored;            /* Stored size, equal if uncompressed.  */
+  };
+
+/* Statistics for the `s' debug flag: the bytes compressed into spilled
+   diversions, and the bytes that they took once compressed.  */
+static unsigned long long spill_raw_bytes;
+static unsigned long long spill_stored_bytes;
 
-/* Diversions that own tmp_file, or 0.  */
-static int tmp_file1_owner;
-static int tmp_file2_owner;
+#endif /* COMPRESS_SPILL */
 
-/* True if tmp_file2 is more recently used.  */
-static bool tmp_file2_recent;
+#if USE_POSIX_THREADS
+
+/* With --async-output, diversion 0 is written through output_cursor
+   like an in-memory diversion, into a ring of ASYNC_BUFFER_COUNT
+   buffers.  Each full buffer is queued for a writer thread, which
+   writes them to standard output in order, so expansion only waits
+   for the output when every buffer is queued.  */
+
+/* True while the writer thread is running.  */
+static bool output_async;
+
+static pthread_t async_thread;
+static char *async_buffers[ASYNC_BUFFER_COUNT];
+static size_t async_used[ASYNC_BUFFER_COUNT];
+
+/* Buffer being filled, only accessed by the main thread.  Its used
+   count is only up to date while diversion 0 is not current.  */
+static int async_fill;
+
+/* The following are protected by async_lock.  async_first is the
+   oldest of async_queued buffers that wait for the writer, and
+   async_done tells it that nothing more is coming.  */
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_filled = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_emptied = PTHREAD_COND_INITIALIZER;
+static int async_first;
+static int async_queued;
+static bool async_done;
+
+/* First error from writing standard output, only accessed by the
+   writer thread until it is joined.  */
+static int async_errno;
+
+#endif /* USE_POSIX_THREADS */
 
 
 /* Internal routines.  */
@@ -148,6 +371,117 @@ threshold_diversion_CB (const void *elt, const void *threshold)
   return diversion->divnum >= *(const int *) threshold;
 }
 
+/* Callback for comparing list elements ELT1 and ELT2 for order in
+   diversion_stats_table.  */
+static int
+cmp_stats_CB (const void *elt1, const void *elt2)
+{
+  const diversion_stats *s1 = (const diversion_stats *) elt1;
+  const diversion_stats *s2 = (const diversion_stats *) elt2;
+  return s1->divnum - s2->divnum;
+}
+
+/* Callback for comparing list element ELT against THRESHOLD.  */
+static bool
+threshold_stats_CB (const void *elt, const void *threshold)
+{
+  const diversion_stats *stats = (const diversion_stats *) elt;
+  return stats->divnum >= *(const int *) threshold;
+}
+
+/* Return the statistics of diversion DIVNUM, creating them the first
+   time the diversion is used.  */
+static diversion_stats *
+diversion_stats_for (int divnum)
+{
+  diversion_stats *stats;
+  const void *elt;
+
+  if (gl_oset_search_atleast (diversion_stats_table, threshold_stats_CB,
+                              &divnum, &elt)
+      && ((const diversion_stats *) elt)->divnum == divnum)
+    return (diversion_stats *) elt;
+  stats = (diversion_stats *) obstack_alloc (&diversion_storage,
+                                             sizeof *stats);
+  memset (stats, 0, sizeof *stats);
+  stats->divnum = divnum;
+  gl_oset_add (diversion_stats_table, stats);
+  return stats;
+}
+
+/* Close the open temporary FILE of a diversion, without deleting it;
+   MEMORY tells whether it is a file in memory.  Files in memory are
+   not known to the temporary directory, and a compressed stream
+   closes the file beneath it itself.  */
+static int
+m4_tmpfclose (FILE *file, bool memory)
+{
+  if (memory || compress_diversions)
+    return close_stream (file);
+  return close_stream_temp (file);
+}
+
+/* Return the index of the file of diversion DIVNUM in tmp_cache, or
+   -1 if it is not open.  */
+static int
+tmp_cache_find (int divnum)
+{
+  int i;
+
+  for (i = 0; i < tmp_cache_count; i++)
+    if (tmp_cache[i].owner == divnum)
+      return i;
+  return -1;
+}
+
+/* Remove entry I from tmp_cache, without closing its file.  */
+static void
+tmp_cache_remove (int i)
+{
+  tmp_cache_count--;
+  memmove (tmp_cache + i, tmp_cache + i + 1,
+           (tmp_cache_count - i) * sizeof *tmp_cache);
+}
+
+/* Put FILE, owned by diversion DIVNUM, first in tmp_cache.  MEMORY
+   tells whether FILE is a file in memory.  */
+static void
+tmp_cache_push (FILE *file, int divnum, bool memory)
+{
+  memmove (tmp_cache + 1, tmp_cache, tmp_cache_count * sizeof *tmp_cache);
+  tmp_cache[0].file = file;
+  tmp_cache[0].owner = divnum;
+  tmp_cache[0].memory = memory;
+  tmp_cache_count++;
+}
+
+/* Return the index of the least recently used file on disk in
+   tmp_cache, or -1 if all of its files are in memory.  */
+static int
+tmp_cache_victim (void)
+{
+  int i;
+
+  for (i = tmp_cache_count - 1; i >= 0; i--)
+    if (!tmp_cache[i].memory)
+      return i;
+  return -1;
+}
+
+/* Close the file at index I of tmp_cache, which is on disk, and
+   remove it.  */
+static int
+tmp_cache_evict (int i)
+{
+  int result;
+
+  assert (!tmp_cache[i].memory);
+  diversion_stats_for (tmp_cache[i].owner)->closes++;
+  result = m4_tmpfclose (tmp_cache[i].file, false);
+  tmp_cache_remove (i);
+  return result;
+}
+
 /* Clean up any temporary directory.  Designed for use as an atexit
    handler, where it is not safe to call exit() recursively; so this
    calls _exit if a problem is encountered.  */
@@ -164,8 +498,10 @@ cleanup_tmpfile (void)
       while (gl_oset_iterator_next (&iter, &elt))
         {
           m4_diversion *diversion = (m4_diversion *) elt;
+          int i = tmp_cache_find (diversion->divnum);
           if (!diversion->size && diversion->u.file
-              && close_stream_temp (diversion->u.file) != 0)
+              && m4_tmpfclose (diversion->u.file,
+                               i >= 0 && tmp_cache[i].memory) != 0)
             {
               M4ERROR ((0, errno,
                         "cannot clean temporary file for diversion"));
@@ -201,6 +537,376 @@ m4_tmpname (int divnum)
   return buffer;
 }
 
+#ifdef COMPRESS_SPILL
+
+/* Store the EXTRA part of a length of 15 or more at OP, as a run of
+   255 bytes ended by a smaller one, and return the end.  */
+static unsigned char *
+lz_length (unsigned char *op, size_t extra)
+{
+  for (; extra >= 255; extra -= 255)
+    *op++ = 255;
+  *op++ = extra;
+  return op;
+}
+
+/* Compress the LENGTH bytes at IN into OUT, which has room for
+   LZ_BOUND (LENGTH) bytes, and return the compressed size.  The format
+   is that of LZ4 blocks: a sequence of literal bytes and matches, each
+   match being a length of at least 4 and an offset of at most 65535
+   back into the uncompressed text.  LENGTH must fit in 32 bits.  */
+static size_t
+lz_compress (const unsigned char *in, size_t length, unsigned char *out)
+{
+  static uint32_t table[1 << LZ_HASH_BITS];
+  const unsigned char *end = in + length;
+  const unsigned char *anchor = in;
+  const unsigned char *cursor = in;
+  unsigned char *op = out;
+  unsigned int misses = 0;
+
+  /* Each entry of table is one more than the offset of the last
+     sequence of four bytes that hashed there, or 0.  */
+  memset (table, 0, sizeof table);
+
+  while (1)
+    {
+      const unsigned char *match = NULL;
+      unsigned char *token;
+      size_t literals;
+      size_t offset;
+      size_t matched;
+
+      /* Find the next match, skipping ahead faster and faster through
+         text that does not compress.  */
+      while (end - cursor >= 4)
+        {
+          uint32_t sequence;
+          uint32_t hash;
+          uint32_t entry;
+
+          memcpy (&sequence, cursor, 4);
+          hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+          entry = table[hash];
+          table[hash] = cursor - in + 1;
+          if (entry && cursor - (in + entry - 1) <= 65535
+              && memcmp (in + entry - 1, cursor, 4) == 0)
+            {
+              match = in + entry - 1;
+              break;
+            }
+          cursor += 1 + (misses++ >> 6);
+        }
+      if (match == NULL)
+        cursor = end;
+
+      /* Emit the token, then the literals before the match.  */
+      literals = cursor - anchor;
+      token = op++;
+      *token = (literals < 15 ? literals : 15) << 4;
+      if (literals >= 15)
+        op = lz_length (op, literals - 15);
+      memcpy (op, anchor, literals);
+      op += literals;
+      if (match == NULL)
+        break;
+
+      /* Emit the match, as long as it goes.  */
+      offset = cursor - match;
+      matched = 4;
+      while (cursor + matched < end && match[matched] == cursor[matched])
+        matched++;
+      *op++ = offset & 0xff;
+      *op++ = offset >> 8;
+      *token |= matched - 4 < 15 ? matched - 4 : 15;
+      if (matched - 4 >= 15)
+        op = lz_length (op, matched - 4 - 15);
+      cursor += matched;
+      anchor = cursor;
+      misses = 0;
+    }
+  return op - out;
+}
+
+/* Decompress the LENGTH bytes at IN, produced by lz_compress, into the
+   SIZE bytes at OUT.  Return false if they do not decompress to
+   exactly SIZE bytes.  */
+static bool
+lz_decompress (const unsigned char *in, size_t length, unsigned char *out,
+               size_t size)
+{
+  const unsigned char *end = in + length;
+  unsigned char *op = out;
+  unsigned char *out_end = out + size;
+
+  while (in < end)
+    {
+      unsigned int token = *in++;
+      size_t count = token >> 4;
+      size_t offset;
+
+      if (count == 15)
+        do
+          {
+            if (in == end)
+              return false;
+            count += *in;
+          }
+        while (*in++ == 255);
+      if ((size_t) (end - in) < count || (size_t) (out_end - op) < count)
+        return false;
+      memcpy (op, in, count);
+      in += count;
+      op += count;
+      if (in == end)
+        break;
+
+      if (end - in < 2)
+        return false;
+      offset = in[0] | (in[1] << 8);
+      in += 2;
+      if (offset == 0 || (size_t) (op - out) < offset)
+        return false;
+      count = token & 15;
+      if (count == 15)
+        do
+          {
+            if (in == end)
+              return false;
+            count += *in;
+          }
+        while (*in++ == 255);
+      count += 4;
+      if ((size_t) (out_end - op) < count)
+        return false;
+      /* The match may overlap the bytes it produces.  */
+      if (offset >= count)
+        {
+          memcpy (op, op - offset, count);
+          op += count;
+        }
+      else
+        for (; count > 0; count--, op++)
+          *op = op[-offset];
+    }
+  return op == out_end;
+}
+
+/* Scratch space for a compressed block, shared by all streams.  */
+static unsigned char *
+spill_scratch (void)
+{
+  static unsigned char *scratch;
+  if (scratch == NULL)
+    scratch = (unsigned char *) xmalloc (LZ_BOUND (SPILL_BLOCK_SIZE));
+  return scratch;
+}
+
+/* Write the SIZE bytes at BUFFER to the compressed stream COOKIE.  */
+static ssize_t
+spill_write (void *cookie, const char *buffer, size_t size)
+{
+  spill_stream *stream = (spill_stream *) cookie;
+  unsigned char *scratch = spill_scratch ();
+  size_t left = size;
+
+  if (stream->reading)
+    {
+      if (fseeko (stream->file, 0, SEEK_END) != 0)
+        return -1;
+      stream->reading = false;
+      stream->block_used = stream->block_read = 0;
+    }
+  while (left > 0)
+    {
+      spill_header header;
+      const void *stored = scratch;
+
+      header.size = left < SPILL_BLOCK_SIZE ? left : SPILL_BLOCK_SIZE;
+      header.stored = lz_compress ((const unsigned char *) buffer,
+                                   header.size, scratch);
+      if (header.stored >= header.size)
+        {
+          header.stored = header.size;
+          stored = buffer;
+        }
+      if (fwrite (&header, sizeof header, 1, stream->file) != 1
+          || fwrite (stored, header.stored, 1, stream->file) != 1)
+        return -1;
+      spill_raw_bytes += header.size;
+      spill_stored_bytes += sizeof header + header.stored;
+      stream->size += header.size;
+      buffer += header.size;
+      left -= header.size;
+    }
+  return size;
+}
+
+/* Read up to SIZE bytes into BUFFER from the compressed stream
+   COOKIE.  */
+static ssize_t
+spill_read (void *cookie, char *buffer, size_t size)
+{
+  spill_stream *stream = (spill_stream *) cookie;
+
+  if (!stream->reading)
+    {
+      if (fseeko (stream->file, 0, SEEK_SET) != 0)
+        return -1;
+      stream->reading = true;
+      stream->position = 0;
+      stream->block_used = stream->block_read = 0;
+    }
+  if (stream->block_read == stream->block_used)
+    {
+      spill_header header;
+      unsigned char *scratch = spill_scratch ();
+      size_t count = fread (&header, 1, sizeof header, stream->file);
+
+      if (count == 0 && !ferror (stream->file))
+        return 0;
+      if (count != sizeof header || header.size > SPILL_BLOCK_SIZE
+          || header.stored > header.size)
+        {
+          errno = EIO;
+          return -1;
+        }
+      if (stream->block == NULL)
+        stream->block = xcharalloc (SPILL_BLOCK_SIZE);
+      if (header.stored == header.size)
+        {
+          if (fread (stream->block, header.size, 1, stream->file) != 1)
+            {
+              errno = EIO;
+              return -1;
+            }
+        }
+      else if (fread (scratch, header.stored, 1, stream->file) != 1
+               || !lz_decompress (scratch, header.stored,
+                                  (unsigned char *) stream->block,
+                                  header.size))
+        {
+          errno = EIO;
+          return -1;
+        }
+      stream->block_used = header.size;
+      stream->block_read = 0;
+    }
+  if (size > stream->block_used - stream->block_read)
+    size = stream->block_used - stream->block_read;
+  memcpy (buffer, stream->block + stream->block_read, size);
+  stream->block_read += size;
+  stream->position += size;
+  return size;
+}
+
+/* Report where the compressed stream COOKIE is, for ftello, which is
+   all the repositioning that it supports.  */
+static int
+spill_seek (void *cookie, off64_t *offset, int whence)
+{
+  spill_stream *stream = (spill_stream *) cookie;
+
+  if (*offset != 0 || whence != SEEK_CUR)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  *offset = stream->reading ? stream->position : stream->size;
+  return 0;
+}
+
+/* Close the compressed stream COOKIE, and the file beneath it.  */
+static int
+spill_close (void *cookie)
+{
+  spill_stream *stream = (spill_stream *) cookie;
+  int result = (stream->memory ? close_stream (stream->file)
+                : close_stream_temp (stream->file));
+
+  free (stream->block);
+  free (stream);
+  return result;
+}
+
+#endif /* COMPRESS_SPILL */
+
+/* Return FILE, the open temporary file of a diversion, or with
+   --compress-diversions, a stream that compresses what is written to
+   FILE and decompresses what is read back, positioned at the end.
+   MEMORY tells whether FILE is a file in memory.  Exits on
+   failure.  */
+static FILE *
+m4_tmpcompress (FILE *file, bool memory)
+{
+#ifdef COMPRESS_SPILL
+  if (compress_diversions)
+    {
+      static const cookie_io_functions_t functions =
+        {
+          spill_read, spill_write, spill_seek, spill_close
+        };
+      spill_stream *stream = (spill_stream *) xmalloc (sizeof *stream);
+      spill_header header;
+
+      /* Find the uncompressed size of the blocks already there.  */
+      stream->file = file;
+      stream->memory = memory;
+      stream->size = 0;
+      while (fread (&header, sizeof header, 1, file) == 1)
+        {
+          stream->size += header.size;
+          if (fseeko (file, header.stored, SEEK_CUR) != 0)
+            break;
+        }
+      if (ferror (file) || fseeko (file, 0, SEEK_END) != 0)
+        M4ERROR ((EXIT_FAILURE, errno, "cannot seek within diversion"));
+      stream->position = 0;
+      stream->reading = false;
+      stream->block = NULL;
+      stream->block_used = stream->block_read = 0;
+
+      file = fopencookie (stream, O_BINARY ? "rb+" : "r+", functions);
+      if (file == NULL)
+        M4ERROR ((EXIT_FAILURE, errno,
+                  "cannot create temporary file for diversion"));
+      setvbuf (file, stream->buffer, _IOFBF, sizeof stream->buffer);
+    }
+#endif /* COMPRESS_SPILL */
+  return file;
+}
+
+/* Position FILE, the open temporary file of a diversion, so that it
+   is read from the start.  Return 0, or EOF with errno set.  */
+static int
+m4_tmprewind (FILE *file)
+{
+#ifdef COMPRESS_SPILL
+  /* A compressed stream starts over on its own.  */
+  if (compress_diversions)
+    return fflush_unlocked (file);
+#endif
+  return fseeko (file, 0, SEEK_SET);
+}
+
+/* Return the size of the text in FILE, the open temporary file of a
+   diversion, or -1 with errno set.  */
+static off_t
+m4_tmpsize (FILE *file)
+{
+  struct stat st;
+
+#ifdef COMPRESS_SPILL
+  /* Only the stream knows the uncompressed size.  It has not been read
+     yet, so it is still where it ends.  */
+  if (compress_diversions)
+    return fflush_unlocked (file) != 0 ? -1 : ftello (file);
+#endif
+  if (fflush (file) != 0 || fstat (fileno (file), &st) != 0)
+    return -1;
+  return st.st_size;
+}
+
 /* Create a temporary file for diversion DIVNUM open for reading and
    writing in a secure temp directory.  The file will be automatically
    closed and deleted on a fatal signal.  The file can be closed and
@@ -214,6 +920,47 @@ m4_tmpfile (int divnum)
   const char *name;
   FILE *file;
 
+  diversion_stats_for (divnum)->opens++;
+#ifdef MEMFD_SPILL
+  if (spill_to_memory && tmp_memory_count < tmp_cache_size - 1)
+    {
+      char buffer[sizeof "m4-" + INT_BUFSIZE_BOUND (int)];
+      int fd;
+
+      sprintf (buffer, "m4-%d", divnum);
+      fd = memfd_create (buffer, 0);
+      if (fd >= 0)
+        {
+          fd = fd_safer (fd);
+          file = fdopen (fd, O_BINARY ? "wb+" : "w+");
+          if (file == NULL)
+            M4ERROR ((EXIT_FAILURE, errno,
+                      "cannot create temporary file for diversion"));
+          if (set_cloexec_flag (fileno (file), true) != 0)
+            M4ERROR ((warning_status, errno,
+                      "Warning: cannot protect diversion across forks"));
+          file = m4_tmpcompress (file, true);
+          /* It cannot be reopened, so it joins the cache right away.  */
+          if (tmp_cache_count == tmp_cache_size
+              && tmp_cache_evict (tmp_cache_victim ()) != 0)
+            m4_error (0, errno,
+                      _("cannot close temporary file for diversion"));
+          tmp_cache_push (file, divnum, true);
+          tmp_memory_count++;
+          return file;
+        }
+      if (errno != ENOSYS && errno != EINVAL)
+        M4ERROR ((EXIT_FAILURE, errno,
+                  "cannot create temporary file for diversion"));
+      /* This is the first spill, so no diversion is in memory yet.  */
+      M4ERROR ((warning_status, errno,
+                "Warning: cannot spill diversions to memory, using files"));
+      spill_to_memory = false;
+    }
+#else /* !MEMFD_SPILL */
+  spill_to_memory = false;
+#endif /* !MEMFD_SPILL */
+
   if (output_temp_dir == NULL)
     {
       output_temp_dir = create_temp_dir ("m4-", NULL, true);
@@ -234,7 +981,7 @@ m4_tmpfile (int divnum)
   else if (set_cloexec_flag (fileno (file), true) != 0)
     M4ERROR ((warning_status, errno,
               "Warning: cannot protect diversion across forks"));
-  return file;
+  return m4_tmpcompress (file, false);
 }
 
 /* Reopen a temporary file for diversion DIVNUM for reading and
@@ -247,23 +994,23 @@ m4_tmpopen (int divnum, bool reread)
 {
   const char *name;
   FILE *file;
+  int i = tmp_cache_find (divnum);
 
-  if (tmp_file1_owner == divnum)
-    {
-      if (reread && fseeko (tmp_file1, 0, SEEK_SET) != 0)
-        m4_error (EXIT_FAILURE, errno,
-                  _("cannot seek within diversion"));
-      tmp_file2_recent = false;
-      return tmp_file1;
-    }
-  else if (tmp_file2_owner == divnum)
+  if (i >= 0)
     {
-      if (reread && fseeko (tmp_file2, 0, SEEK_SET) != 0)
+      bool memory = tmp_cache[i].memory;
+      file = tmp_cache[i].file;
+      if (reread && m4_tmprewind (file) != 0)
         m4_error (EXIT_FAILURE, errno,
                   _("cannot seek within diversion"));
-      tmp_file2_recent = true;
-      return tmp_file2;
+      tmp_cache_remove (i);
+      if (memory)
+        tmp_cache_push (file, divnum, true);
+      tmp_cache_hits++;
+      return file;
     }
+  tmp_cache_misses++;
+  diversion_stats_for (divnum)->opens++;
   name = m4_tmpname (divnum);
   /* We need update mode, to avoid truncation.  */
   file = fopen_temp (name, O_BINARY ? "rb+" : "r+");
@@ -272,9 +1019,10 @@ m4_tmpopen (int divnum, bool reread)
               "cannot create temporary file for diversion"));
   else if (set_cloexec_flag (fileno (file), true) != 0)
     m4_error (0, errno, _("cannot protect diversion across forks"));
+  file = m4_tmpcompress (file, false);
   /* Update mode starts at the beginning of the stream, but sometimes
      we want the end.  */
-  else if (!reread && fseeko (file, 0, SEEK_END) != 0)
+  if (!reread && !compress_diversions && fseeko (file, 0, SEEK_END) != 0)
     m4_error (EXIT_FAILURE, errno,
               _("cannot seek within diversion"));
   return file;
@@ -282,29 +1030,20 @@ m4_tmpopen (int divnum, bool reread)
 
 /* Close, but don't delete, a temporary FILE for diversion DIVNUM.  To
    reduce the I/O overhead of repeatedly opening and closing the same
-   file, this implementation caches the most recent spilled diversion.
-   On the other hand, keeping every spilled diversion open would run
-   into EMFILE limits.  */
+   file, this implementation caches the most recently used spilled
+   diversions.  On the other hand, keeping every spilled diversion open
+   would run into EMFILE limits, so the least recently used file on
+   disk is closed once tmp_cache is full.  A file in memory never left
+   the cache.  */
 static int
 m4_tmpclose (FILE *file, int divnum)
 {
   int result = 0;
-  if (divnum != tmp_file1_owner && divnum != tmp_file2_owner)
+  if (tmp_cache_find (divnum) < 0)
     {
-      if (tmp_file2_recent)
-        {
-          if (tmp_file1_owner)
-            result = close_stream_temp (tmp_file1);
-          tmp_file1 = file;
-          tmp_file1_owner = divnum;
-        }
-      else
-        {
-          if (tmp_file2_owner)
-            result = close_stream_temp (tmp_file2);
-          tmp_file2 = file;
-          tmp_file2_owner = divnum;
-        }
+      if (tmp_cache_count == tmp_cache_size)
+        result = tmp_cache_evict (tmp_cache_victim ());
+      tmp_cache_push (file, divnum, false);
     }
   return result;
 }
@@ -313,19 +1052,20 @@ m4_tmpclose (FILE *file, int divnum)
 static int
 m4_tmpremove (int divnum)
 {
-  if (divnum == tmp_file1_owner)
+  int i = tmp_cache_find (divnum);
+  if (i >= 0)
     {
-      int result = close_stream_temp (tmp_file1);
+      bool memory = tmp_cache[i].memory;
+      int result = m4_tmpfclose (tmp_cache[i].file, memory);
       if (result)
         return result;
-      tmp_file1_owner = 0;
-    }
-  else if (divnum == tmp_file2_owner)
-    {
-      int result = close_stream_temp (tmp_file2);
-      if (result)
-        return result;
-      tmp_file2_owner = 0;
+      tmp_cache_remove (i);
+      diversion_stats_for (divnum)->closes++;
+      if (memory)
+        {
+          tmp_memory_count--;
+          return 0;
+        }
     }
   return cleanup_temp_file (output_temp_dir, m4_tmpname (divnum));
 }
@@ -336,34 +1076,31 @@ m4_tmpremove (int divnum)
 static FILE*
 m4_tmprename (int oldnum, int newnum)
 {
-  /* m4_tmpname reuses its return buffer.  */
-  char *oldname = xstrdup (m4_tmpname (oldnum));
-  const char *newname = m4_tmpname (newnum);
-  register_temp_file (output_temp_dir, newname);
-  if (oldnum == tmp_file1_owner)
+  char *oldname;
+  const char *newname;
+  int i = tmp_cache_find (oldnum);
+
+  if (i >= 0 && tmp_cache[i].memory)
     {
-      /* Be careful of mingw, which can't rename an open file.  */
-      if (RENAME_OPEN_FILE_WORKS)
-        tmp_file1_owner = newnum;
-      else
-        {
-          if (close_stream_temp (tmp_file1))
-            m4_error (EXIT_FAILURE, errno,
-                      _("cannot close temporary file for diversion"));
-          tmp_file1_owner = 0;
-        }
+      /* A file in memory has no name, and is always open.  */
+      tmp_cache[i].owner = newnum;
+      return m4_tmpopen (newnum, false);
     }
-  else if (oldnum == tmp_file2_owner)
+
+  /* m4_tmpname reuses its return buffer.  */
+  oldname = xstrdup (m4_tmpname (oldnum));
+  newname = m4_tmpname (newnum);
+  register_temp_file (output_temp_dir, newname);
+  if (i >= 0)
     {
       /* Be careful of mingw, which can't rename an open file.  */
       if (RENAME_OPEN_FILE_WORKS)
-        tmp_file2_owner = newnum;
+        tmp_cache[i].owner = newnum;
       else
         {
-          if (close_stream_temp (tmp_file2))
+          if (tmp_cache_evict (i))
             m4_error (EXIT_FAILURE, errno,
                       _("cannot close temporary file for diversion"));
-          tmp_file2_owner = 0;
         }
     }
   /* Either it is safe to rename an open file, or no one should have
@@ -377,6 +1114,220 @@ m4_tmprename (int oldnum, int newnum)
 }
 
 
+/*-------------------------------------------------------------------.
+| Return the default limit for the total size of in-memory diversion |
+| buffers, based on the amount of memory available.                  |
+`-------------------------------------------------------------------*/
+
+static size_t
+default_total_size (void)
+{
+  size_t result = MINIMUM_TOTAL_SIZE;
+
+#if defined _SC_AVPHYS_PAGES && defined _SC_PAGESIZE
+  long int pages = sysconf (_SC_AVPHYS_PAGES);
+  long int pagesize = sysconf (_SC_PAGESIZE);
+
+  if (pages > 0 && pagesize > 0)
+    {
+      double available = (double) pages * pagesize / 8;
+      if (available > SIZE_MAX / 4)
+        result = SIZE_MAX / 4;
+      else if (available > result)
+        result = available;
+    }
+#endif
+  return result;
+}
+
+#if USE_POSIX_THREADS
+
+/*---------------------------------------------------------------.
+| Body of the writer thread for --async-output.  Write each      |
+| queued buffer to standard output, until told to stop.  After a |
+| write error, the rest of the output is discarded, and the      |
+| error is reported at exit.                                     |
+`---------------------------------------------------------------*/
+
+static void *
+async_writer (void *arg M4_GNUC_UNUSED)
+{
+  const char *text;
+  size_t length;
+  ssize_t written;
+  int i;
+
+  pthread_mutex_lock (&async_lock);
+  while (true)
+    {
+      while (!async_queued && !async_done)
+        pthread_cond_wait (&async_filled, &async_lock);
+      if (!async_queued)
+        break;
+      i = async_first;
+      pthread_mutex_unlock (&async_lock);
+
+      text = async_buffers[i];
+      length = async_used[i];
+      while (length > 0 && !async_errno)
+        {
+          written = write (STDOUT_FILENO, text, length);
+          if (written < 0)
+            {
+              if (errno != EINTR)
+                async_errno = errno;
+            }
+          else
+            {
+              text += written;
+              length -= written;
+            }
+        }
+
+      pthread_mutex_lock (&async_lock);
+      async_first = (i + 1) % ASYNC_BUFFER_COUNT;
+      async_queued--;
+      pthread_cond_signal (&async_emptied);
+    }
+  pthread_mutex_unlock (&async_lock);
+  return NULL;
+}
+
+/* Record how much of the buffer being filled is used, if diversion 0
+   is current and writes to it through output_cursor.  */
+static void
+sync_async_buffer (void)
+{
+  if (output_diversion == &div0 && !output_file)
+    async_used[async_fill] = output_cursor - async_buffers[async_fill];
+}
+
+/* Queue the buffer being filled for the writer thread, and start
+   filling the next one, once the writer has emptied it.  */
+static void
+queue_async_buffer (void)
+{
+  pthread_mutex_lock (&async_lock);
+  async_queued++;
+  pthread_cond_signal (&async_filled);
+  while (async_queued == ASYNC_BUFFER_COUNT)
+    pthread_cond_wait (&async_emptied, &async_lock);
+  pthread_mutex_unlock (&async_lock);
+
+  async_fill = (async_fill + 1) % ASYNC_BUFFER_COUNT;
+  async_used[async_fill] = 0;
+  if (output_diversion == &div0 && !output_file)
+    {
+      output_cursor = async_buffers[async_fill];
+      output_unused = ASYNC_BUFFER_SIZE;
+    }
+}
+
+/* Write out all buffered output, and stop the writer thread.  */
+static void
+stop_async_output (void)
+{
+  if (!output_async)
+    return;
+  output_flush ();
+
+  pthread_mutex_lock (&async_lock);
+  async_done = true;
+  pthread_cond_signal (&async_filled);
+  pthread_mutex_unlock (&async_lock);
+  pthread_join (async_thread, NULL);
+
+  output_async = false;
+  free (async_buffers[0]);
+  if (output_diversion == &div0 && !output_file)
+    {
+      output_file = stdout;
+      output_cursor = NULL;
+      output_unused = 0;
+    }
+}
+
+/* Atexit handler, for when m4 exits without calling output_exit, as
+   after a fatal error or m4exit.  Like close_stdout, report a write
+   error by exiting with failure.  */
+static void
+async_output_atexit (void)
+{
+  stop_async_output ();
+  if (async_errno)
+    {
+      error (0, async_errno, _("write error"));
+      _exit (exit_failure);
+    }
+}
+
+/* Start the writer thread, and direct diversion 0 to its buffers.
+   Signals other than those caused by the writer itself are blocked
+   in it, so that their handlers run in the main thread.  On failure,
+   output stays synchronous.  */
+static void
+start_async_output (void)
+{
+  sigset_t blocked, saved;
+  int i;
+  int err;
+
+  async_buffers[0] = xcharalloc (ASYNC_BUFFER_SIZE * ASYNC_BUFFER_COUNT);
+  for (i = 1; i < ASYNC_BUFFER_COUNT; i++)
+    async_buffers[i] = async_buffers[i - 1] + ASYNC_BUFFER_SIZE;
+
+  sigfillset (&blocked);
+  sigdelset (&blocked, SIGPIPE);
+  sigdelset (&blocked, SIGSEGV);
+  sigdelset (&blocked, SIGBUS);
+  sigdelset (&blocked, SIGFPE);
+  sigdelset (&blocked, SIGILL);
+  pthread_sigmask (SIG_SETMASK, &blocked, &saved);
+  err = pthread_create (&async_thread, NULL, async_writer, NULL);
+  pthread_sigmask (SIG_SETMASK, &saved, NULL);
+  if (err != 0)
+    {
+      M4ERROR ((warning_status, err,
+                "Warning: cannot start output thread, writing directly"));
+      free (async_buffers[0]);
+      return;
+    }
+
+  /* Debug messages that go to stdout are written between buffers, see
+     output_flush, and must not linger in the stdio buffer.  */
+  setvbuf (stdout, NULL, _IOLBF, BUFSIZ);
+
+  output_async = true;
+  output_file = NULL;
+  output_cursor = async_buffers[0];
+  output_unused = ASYNC_BUFFER_SIZE;
+  atexit (async_output_atexit);
+}
+
+#endif /* USE_POSIX_THREADS */
+
+/*-------------------------------------------------------------------.
+| With --async-output, wait until everything sent to diversion 0 has |
+| been written to standard output.  Used before anything else may    |
+| write there, like debug messages or the output of syscmd.          |
+`-------------------------------------------------------------------*/
+
+void
+output_flush (void)
+{
+#if USE_POSIX_THREADS
+  if (!output_async)
+    return;
+  sync_async_buffer ();
+  if (async_used[async_fill] > 0)
+    queue_async_buffer ();
+  pthread_mutex_lock (&async_lock);
+  while (async_queued)
+    pthread_cond_wait (&async_emptied, &async_lock);
+  pthread_mutex_unlock (&async_lock);
+#endif /* USE_POSIX_THREADS */
+}
+
 /*------------------------.
 | Output initialization.  |
 `------------------------*/
@@ -386,10 +1337,111 @@ output_init (void)
 {
   diversion_table = gl_oset_create_empty (GL_AVLTREE_OSET, cmp_diversion_CB,
                                           NULL);
+  diversion_stats_table = gl_oset_create_empty (GL_AVLTREE_OSET,
+                                                cmp_stats_CB, NULL);
   div0.u.file = stdout;
   output_diversion = &div0;
   output_file = stdout;
   obstack_init (&diversion_storage);
+  maximum_total_size = (diversion_memory ? diversion_memory
+                        : default_total_size ());
+
+  tmp_cache_size = diversion_files ? diversion_files : DEFAULT_TMP_CACHE_SIZE;
+#if HAVE_SETRLIMIT
+  {
+    struct rlimit limit;
+    if (getrlimit (RLIMIT_NOFILE, &limit) == 0
+        && limit.rlim_cur != RLIM_INFINITY
+        && (rlim_t) tmp_cache_size > limit.rlim_cur / 2)
+      tmp_cache_size = limit.rlim_cur / 2;
+  }
+#endif
+  if (tmp_cache_size < MINIMUM_TMP_CACHE_SIZE)
+    tmp_cache_size = MINIMUM_TMP_CACHE_SIZE;
+
+#ifndef COMPRESS_SPILL
+  if (compress_diversions)
+    {
+      M4ERROR ((warning_status, 0,
+                "Warning: cannot compress diversions, storing them as is"));
+      compress_diversions = false;
+    }
+#endif
+  tmp_cache = (tmp_cache_entry *) xnmalloc (tmp_cache_size,
+                                            sizeof *tmp_cache);
+
+#if USE_POSIX_THREADS
+  if (async_output)
+    start_async_output ();
+  if (output_async)
+    return;
+#else /* !USE_POSIX_THREADS */
+  if (async_output)
+    {
+      M4ERROR ((warning_status, 0,
+                "Warning: cannot start output thread, writing directly"));
+      async_output = false;
+    }
+#endif /* !USE_POSIX_THREADS */
+
+  /* Stdio sizes the buffer of standard output after the block size of
+     the file, which is a write for every few kilobytes of output to a
+     pipe.  Unless interactive, use a bigger one for anything but a
+     terminal, which stays line buffered.  */
+  if (output_buffer_size != 0 && !isatty (STDOUT_FILENO))
+    {
+      stdout_buffer = (char *) malloc (output_buffer_size);
+      if (stdout_buffer != NULL)
+        setvbuf (stdout, stdout_buffer, _IOFBF, output_buffer_size);
+    }
+}
+
+/*-------------------------------------------------------------------.
+| Print the statistics of diversion buffers, for the `s' debug flag, |
+| followed by those of each diversion that was used.                 |
+`-------------------------------------------------------------------*/
+
+void
+show_diversion_stats (void)
+{
+  gl_oset_iterator_t iter;
+  const void *elt;
+
+  DEBUG_MESSAGE2 ("diversion memory: %lu bytes allowed, %lu bytes peak",
+                  (unsigned long int) maximum_total_size,
+                  (unsigned long int) peak_buffer_size);
+  DEBUG_MESSAGE2 ("diversion spills: %lu, %llu bytes",
+                  spill_count, spill_bytes);
+  DEBUG_MESSAGE2 ("diversion files: %lu hits, %lu misses",
+                  tmp_cache_hits, tmp_cache_misses);
+#ifdef COMPRESS_SPILL
+  if (compress_diversions)
+    DEBUG_MESSAGE2 ("diversion compression: %llu bytes to %llu bytes",
+                    spill_raw_bytes, spill_stored_bytes);
+#endif
+
+  if (debug == NULL)
+    return;
+  iter = gl_oset_iterator (diversion_stats_table);
+  while (gl_oset_iterator_next (&iter, &elt))
+    {
+      const diversion_stats *stats = (const diversion_stats *) elt;
+      debug_message_prefix ();
+      xfprintf (debug, "diversion %d: %lu bytes peak, %llu bytes undiverted"
+                " in %lu undiverts, %lu spills", stats->divnum,
+                (unsigned long int) stats->peak_size, stats->undiverted,
+                stats->undiverts, stats->spills);
+      if (!stats->spills)
+        ;
+      else if (*stats->spill_file)
+        xfprintf (debug, " (first at %s:%d)", stats->spill_file,
+                  stats->spill_line);
+      else
+        fputs (" (first at end of input)", debug);
+      xfprintf (debug, ", %lu opens, %lu closes\n", stats->opens,
+                stats->closes);
+    }
+  gl_oset_iterator_free (&iter);
 }
 
 void
@@ -398,58 +1450,183 @@ output_exit (void)
   /* Order is important, since we may have registered cleanup_tmpfile
      as an atexit handler, and it must not traverse stale memory.  */
   gl_oset_t table = diversion_table;
-  if (tmp_file1_owner)
-    m4_tmpremove (tmp_file1_owner);
-  if (tmp_file2_owner)
-    m4_tmpremove (tmp_file2_owner);
+#if USE_POSIX_THREADS
+  stop_async_output ();
+  if (async_errno)
+    {
+      M4ERROR ((0, async_errno, "write error"));
+      retcode = EXIT_FAILURE;
+      async_errno = 0;
+    }
+#endif
+  while (tmp_cache_count > 0)
+    if (m4_tmpremove (tmp_cache[0].owner) != 0)
+      break;
   diversion_table = NULL;
   gl_oset_free (table);
+  gl_oset_free (diversion_stats_table);
   obstack_free (&diversion_storage, NULL);
+  free (tmp_cache);
 }
 
-/*----------------------------------------------------------------.
-| Reorganize in-memory diversion buffers so the current diversion |
-| can accomodate LENGTH more characters without further           |
-| reorganization.  The current diversion buffer is made bigger if |
-| possible.  But to make room for a bigger buffer, one of the     |
-| in-memory diversion buffers might have to be flushed to a newly |
-| created temporary file.  This flushed buffer might well be the  |
-| current one.                                                    |
-`----------------------------------------------------------------*/
+/* Free the buffer of standard output.  Designed for use as an atexit
+   handler that runs after close_stdin.  */
+void
+output_free_buffer (void)
+{
+  free (stdout_buffer);
+  stdout_buffer = NULL;
+}
+
+/*------------------------------------------------------------------.
+| Account for the bytes written through output_cursor into the last |
+| chunk of the current in-memory diversion since the last call.     |
+`------------------------------------------------------------------*/
+
+static void
+sync_output_chunk (void)
+{
+  diversion_chunk *tail = output_diversion->tail;
+  size_t used = tail->size - output_unused;
+
+  output_diversion->used += used - tail->used;
+  tail->used = used;
+}
+
+/*-----------------------------------------.
+| Free the list of diversion chunks CHUNK. |
+`-----------------------------------------*/
+
+static void
+free_chunks (diversion_chunk *chunk)
+{
+  diversion_chunk *next;
+
+  for (; chunk != NULL; chunk = next)
+    {
+      next = chunk->next;
+      free (chunk);
+    }
+}
+
+/*--------------------------------------------------------------------.
+| Write the text of the list of diversion chunks CHUNK to FILE.       |
+| Where available, the stream is flushed and the chunks are handed to |
+| the kernel with writev, rather than copied through the stdio        |
+| buffer, unless the stream has no file descriptor, like a compressed |
+| one.  Return false, with errno set, on failure.                     |
+`--------------------------------------------------------------------*/
+
+static bool
+write_chunks (FILE *file, diversion_chunk *chunk)
+{
+#if UNIX
+  struct iovec iov[CHUNK_IOV_COUNT];
+  int fd = fileno (file);
+  int count;
+  int i;
+  ssize_t written;
+
+  if (fd >= 0)
+    {
+      if (fflush (file) != 0)
+        return false;
+      while (chunk != NULL)
+        {
+          for (count = 0; chunk != NULL && count < CHUNK_IOV_COUNT;
+               chunk = chunk->next)
+            if (chunk->used > 0)
+              {
+                iov[count].iov_base = chunk->text;
+                iov[count].iov_len = chunk->used;
+                count++;
+              }
+          i = 0;
+          while (i < count)
+            {
+              written = writev (fd, iov + i, count - i);
+              if (written < 0)
+                {
+                  if (errno == EINTR)
+                    continue;
+                  return false;
+                }
+              while (i < count && (size_t) written >= iov[i].iov_len)
+                written -= iov[i++].iov_len;
+              if (i < count)
+                {
+                  iov[i].iov_base = (char *) iov[i].iov_base + written;
+                  iov[i].iov_len -= written;
+                }
+            }
+        }
+      return true;
+    }
+#endif /* UNIX */
+  for (; chunk != NULL; chunk = chunk->next)
+    if (chunk->used > 0 && fwrite (chunk->text, chunk->used, 1, file) != 1)
+      return false;
+  return true;
+}
+
+/*-------------------------------------------------------------------.
+| Reorganize in-memory diversions so the current diversion can       |
+| accomodate LENGTH more characters without further reorganization.  |
+| A new chunk is normally added to the current diversion.  But to    |
+| make room for it, one of the in-memory diversions might have to be |
+| flushed to a newly created temporary file.  This flushed diversion |
+| might well be the current one.                                     |
+`-------------------------------------------------------------------*/
 
 static void
-make_room_for (int length)
+make_room_for (size_t length)
 {
-  int wanted_size;
+  size_t wanted_size;
   m4_diversion *selected_diversion = NULL;
+  diversion_chunk *chunk;
 
-  /* Compute needed size for in-memory buffer.  Diversions in-memory
-     buffers start at 0 bytes, then 512, then keep doubling until it is
-     decided to flush them to disk.  */
+#if USE_POSIX_THREADS
+  /* Asynchronous output merely moves on to the next buffer, since
+     output_text never asks for more than one buffer at once.  */
+  if (output_diversion == &div0)
+    {
+      sync_async_buffer ();
+      queue_async_buffer ();
+      return;
+    }
+#endif
 
-  output_diversion->used = output_diversion->size - output_unused;
+  /* Compute the size of the new chunk.  The first one has 512 bytes,
+     and each following one doubles, up to MAXIMUM_CHUNK_SIZE.  */
 
-  for (wanted_size = output_diversion->size;
-       wanted_size < output_diversion->used + length;
-       wanted_size = wanted_size == 0 ? INITIAL_BUFFER_SIZE : wanted_size * 2)
-    ;
+  if (output_diversion->size)
+    {
+      sync_output_chunk ();
+      wanted_size = output_diversion->tail->size * 2;
+      if (wanted_size > MAXIMUM_CHUNK_SIZE)
+        wanted_size = MAXIMUM_CHUNK_SIZE;
+    }
+  else
+    wanted_size = INITIAL_BUFFER_SIZE;
+  if (wanted_size < length)
+    wanted_size = length;
 
   /* Check if we are exceeding the maximum amount of buffer memory.  */
 
-  if (total_buffer_size - output_diversion->size + wanted_size
-      > MAXIMUM_TOTAL_SIZE)
+  if (total_buffer_size + wanted_size > maximum_total_size)
     {
-      int selected_used;
-      char *selected_buffer;
+      size_t selected_used;
+      diversion_chunk *selected_chunks;
+      diversion_stats *stats;
       m4_diversion *diversion;
-      int count;
       gl_oset_iterator_t iter;
       const void *elt;
 
-      /* Find out the buffer having most data, in view of flushing it to
-         disk.  Fake the current buffer as having already received the
-         projected data, while making the selection.  So, if it is
-         selected indeed, we will flush it smaller, before it grows.  */
+      /* Find out the diversion having most data, in view of flushing
+         it to disk.  Fake the current diversion as having already
+         received the projected data, while making the selection.  So,
+         if it is selected indeed, we will flush it smaller, before it
+         grows.  */
 
       selected_diversion = output_diversion;
       selected_used = output_diversion->used + length;
@@ -466,30 +1643,37 @@ make_room_for (int length)
         }
       gl_oset_iterator_free (&iter);
 
-      /* Create a temporary file, write the in-memory buffer of the
-         diversion to this file, then release the buffer.  Zero the
-         diversion before doing anything that can exit () (including
-         m4_tmpfile), so that the atexit handler doesn't try to close
-         a garbage pointer as a file.  */
+      /* Create a temporary file, write the chunks of the diversion to
+         this file, then release them.  Zero the diversion before doing
+         anything that can exit () (including m4_tmpfile), so that the
+         atexit handler doesn't try to close a garbage pointer as a
+         file.  */
 
-      selected_buffer = selected_diversion->u.buffer;
+      stats = selected_diversion->stats;
+      if (!stats->spills++)
+        {
+          /* The input file names do not outlive the input.  */
+          stats->spill_file = (char *) obstack_copy0 (&diversion_storage,
+                                                      current_file,
+                                                      strlen (current_file));
+          stats->spill_line = current_line;
+        }
+      selected_chunks = selected_diversion->u.chunks;
       total_buffer_size -= selected_diversion->size;
       selected_diversion->size = 0;
+      selected_diversion->tail = NULL;
       selected_diversion->u.file = NULL;
       selected_diversion->u.file = m4_tmpfile (selected_diversion->divnum);
 
-      if (selected_diversion->used > 0)
-        {
-          count = fwrite (selected_buffer, (size_t) selected_diversion->used,
-                          1, selected_diversion->u.file);
-          if (count != 1)
-            M4ERROR ((EXIT_FAILURE, errno,
-                      "ERROR: cannot flush diversion to temporary file"));
-        }
+      if (!write_chunks (selected_diversion->u.file, selected_chunks))
+        M4ERROR ((EXIT_FAILURE, errno,
+                  "ERROR: cannot flush diversion to temporary file"));
+      spill_count++;
+      spill_bytes += selected_diversion->used;
 
-      /* Reclaim the buffer space for other diversions.  */
+      /* Reclaim the chunks for other diversions.  */
 
-      free (selected_buffer);
+      free_chunks (selected_chunks);
       selected_diversion->used = 1;
     }
 
@@ -515,19 +1699,27 @@ make_room_for (int length)
                       _("cannot close temporary file for diversion"));
         }
 
-      /* The current buffer may be safely reallocated.  */
-      {
-        char *buffer = output_diversion->u.buffer;
-        output_diversion->u.buffer = xcharalloc ((size_t) wanted_size);
-        memcpy (output_diversion->u.buffer, buffer, output_diversion->used);
-        free (buffer);
-      }
-
-      total_buffer_size += wanted_size - output_diversion->size;
-      output_diversion->size = wanted_size;
-
-      output_cursor = output_diversion->u.buffer + output_diversion->used;
-      output_unused = wanted_size - output_diversion->used;
+      /* Append a new chunk to the current diversion.  */
+      chunk = (diversion_chunk *) xmalloc (sizeof *chunk + wanted_size);
+      chunk->next = NULL;
+      chunk->size = wanted_size;
+      chunk->used = 0;
+      chunk->text = (char *) (chunk + 1);
+      if (output_diversion->size)
+        output_diversion->tail->next = chunk;
+      else
+        output_diversion->u.chunks = chunk;
+      output_diversion->tail = chunk;
+
+      total_buffer_size += wanted_size;
+      if (total_buffer_size > peak_buffer_size)
+        peak_buffer_size = total_buffer_size;
+      output_diversion->size += wanted_size;
+      if (output_diversion->size > output_diversion->stats->peak_size)
+        output_diversion->stats->peak_size = output_diversion->size;
+
+      output_cursor = chunk->text;
+      output_unused = wanted_size;
     }
 }
 
@@ -571,8 +1763,30 @@ output_text (const char *text, int length)
   if (!output_diversion || !length)
     return;
 
-  if (!output_file && length > output_unused)
-    make_room_for (length);
+  if (!output_file && (size_t) length > output_unused)
+    {
+      /* Fill the last chunk before adding another.  */
+      if (output_unused > 0)
+        {
+          memcpy (output_cursor, text, output_unused);
+          text += output_unused;
+          length -= output_unused;
+          output_cursor += output_unused;
+          output_unused = 0;
+        }
+#if USE_POSIX_THREADS
+      while (output_diversion == &div0 && length > ASYNC_BUFFER_SIZE)
+        {
+          make_room_for (ASYNC_BUFFER_SIZE);
+          memcpy (output_cursor, text, ASYNC_BUFFER_SIZE);
+          text += ASYNC_BUFFER_SIZE;
+          length -= ASYNC_BUFFER_SIZE;
+          output_cursor += ASYNC_BUFFER_SIZE;
+          output_unused = 0;
+        }
+#endif
+      make_room_for (length);
+    }
 
   if (output_file)
     {
@@ -607,7 +1821,9 @@ void
 shipout_text (struct obstack *obs, const char *text, int length, int line)
 {
   static bool start_of_output_line = true;
-  const char *cursor;
+  char directive[sizeof "#line " + INT_BUFSIZE_BOUND (int) + sizeof " \""];
+  const char *newline;
+  int count;
 
   /* If output goes to an obstack, merely add TEXT to it.  */
 
@@ -667,29 +1883,25 @@ shipout_text (struct obstack *obs, const char *text, int length, int line)
 
           if (output_current_line != line)
             {
-              OUTPUT_CHARACTER ('#');
-              OUTPUT_CHARACTER ('l');
-              OUTPUT_CHARACTER ('i');
-              OUTPUT_CHARACTER ('n');
-              OUTPUT_CHARACTER ('e');
-              OUTPUT_CHARACTER (' ');
-              for (cursor = ntoa (line, 10); *cursor; cursor++)
-                OUTPUT_CHARACTER (*cursor);
               if (output_current_line < 1 && current_file[0] != '\0')
                 {
-                  OUTPUT_CHARACTER (' ');
-                  OUTPUT_CHARACTER ('"');
-                  for (cursor = current_file; *cursor; cursor++)
-                    OUTPUT_CHARACTER (*cursor);
-                  OUTPUT_CHARACTER ('"');
+                  count = sprintf (directive, "#line %d \"", line);
+                  output_text (directive, count);
+                  output_text (current_file, strlen (current_file));
+                  output_text ("\"\n", 2);
+                }
+              else
+                {
+                  count = sprintf (directive, "#line %d\n", line);
+                  output_text (directive, count);
                 }
-              OUTPUT_CHARACTER ('\n');
               output_current_line = line;
             }
         }
 
-      /* Output the token, and track embedded newlines.  */
-      for (; length-- > 0; text++)
+      /* Output the token a line at a time, and track embedded
+         newlines.  */
+      while (length > 0)
         {
           if (start_of_output_line)
             {
@@ -700,8 +1912,21 @@ shipout_text (struct obstack *obs, const char *text, int length, int line)
                        line, current_line, output_current_line);
 #endif
             }
-          OUTPUT_CHARACTER (*text);
-          if (*text == '\n')
+          newline = (const char *) memchr (text, '\n', length);
+          count = newline ? newline - text + 1 : length;
+          length -= count;
+          if (count > 8)
+            {
+              output_text (text, count);
+              text += count;
+            }
+          else
+            while (count-- > 0)
+              {
+                OUTPUT_CHARACTER (*text);
+                text++;
+              }
+          if (newline)
             start_of_output_line = true;
         }
     }
@@ -736,7 +1961,11 @@ make_diversion (int divnum)
           free_list = output_diversion;
         }
       else if (output_diversion->size)
-        output_diversion->used = output_diversion->size - output_unused;
+        sync_output_chunk ();
+#if USE_POSIX_THREADS
+      else if (output_async && output_diversion == &div0)
+        sync_async_buffer ();
+#endif
       else if (output_diversion->used)
         {
           FILE *file = output_diversion->u.file;
@@ -785,15 +2014,26 @@ make_diversion (int divnum)
           diversion->used = 0;
         }
       diversion->u.file = NULL;
+      diversion->tail = NULL;
       diversion->divnum = divnum;
+      diversion->stats = diversion_stats_for (divnum);
       gl_oset_add (diversion_table, diversion);
     }
 
   output_diversion = diversion;
+#if USE_POSIX_THREADS
+  if (output_async && output_diversion == &div0)
+    {
+      output_cursor = async_buffers[async_fill] + async_used[async_fill];
+      output_unused = ASYNC_BUFFER_SIZE - async_used[async_fill];
+    }
+  else
+#endif
   if (output_diversion->size)
     {
-      output_cursor = output_diversion->u.buffer + output_diversion->used;
-      output_unused = output_diversion->size - output_diversion->used;
+      diversion_chunk *tail = output_diversion->tail;
+      output_cursor = tail->text + tail->used;
+      output_unused = tail->size - tail->used;
     }
   else
     {
@@ -808,23 +2048,113 @@ make_diversion (int divnum)
 /*-------------------------------------------------------------------.
 | Insert a FILE into the current output file, in the same manner     |
 | diversions are handled.  This allows files to be included, without |
-| having them rescanned by m4.                                       |
+| having them rescanned by m4.  A regular file is copied by the      |
+| kernel where possible, and otherwise through a buffer sized to it. |
 `-------------------------------------------------------------------*/
 
+#ifdef KERNEL_COPY
+
+/*-------------------------------------------------------------------.
+| Copy FILE, a regular file of SIZE bytes, to output_file within the |
+| kernel, starting from the current position of FILE.  Return true   |
+| if it was copied up to SIZE, or false if the kernel cannot copy    |
+| between these two descriptors.  Either way, FILE is left           |
+| positioned after what was copied, so that the caller may copy the  |
+| rest by other means.                                               |
+`-------------------------------------------------------------------*/
+
+static bool
+copy_file_in_kernel (FILE *file, off_t size)
+{
+  off_t offset;
+  ssize_t copied;
+  int in = fileno (file);
+  int out = fileno (output_file);
+# ifdef KERNEL_COPY_FILE_RANGE
+  bool use_sendfile = false;
+# endif
+
+  offset = ftello (file);
+  if (offset < 0 || offset >= size)
+    return false;
+  if (fflush (output_file) != 0)
+    M4ERROR ((EXIT_FAILURE, errno, "ERROR: copying inserted file"));
+
+  while (offset < size)
+    {
+      size_t wanted = KERNEL_COPY_SIZE;
+      if ((off_t) wanted > size - offset)
+        wanted = size - offset;
+# ifdef KERNEL_COPY_FILE_RANGE
+      if (!use_sendfile)
+        copied = copy_file_range (in, &offset, out, NULL, wanted, 0);
+      else
+# endif
+        copied = sendfile (out, in, &offset, wanted);
+      if (copied > 0)
+        continue;
+      if (copied == 0)
+        break;
+      if (errno == EINTR)
+        continue;
+      if (errno != EINVAL && errno != ENOSYS && errno != EXDEV
+          && errno != EBADF && errno != EOPNOTSUPP)
+        M4ERROR ((EXIT_FAILURE, errno, "ERROR: copying inserted file"));
+# ifdef KERNEL_COPY_FILE_RANGE
+      if (!use_sendfile)
+        {
+          use_sendfile = true;
+          continue;
+        }
+# endif
+      break;
+    }
+
+  if (fseeko (file, offset, SEEK_SET) != 0)
+    M4ERROR ((EXIT_FAILURE, errno, "error reading inserted file"));
+  return offset >= size;
+}
+
+#endif /* KERNEL_COPY */
+
 void
 insert_file (FILE *file)
 {
-  static char buffer[COPY_BUFFER_SIZE];
+  static char *buffer;
+  static size_t buffer_size;
+  size_t wanted = COPY_BUFFER_SIZE;
   size_t length;
+  struct stat st;
 
   /* Optimize out inserting into a sink.  */
   if (!output_diversion)
     return;
 
+  if (fstat (fileno (file), &st) == 0 && S_ISREG (st.st_mode))
+    {
+      bool copied = false;
+#ifdef KERNEL_COPY
+      /* Let the kernel do the copying when the output is a file or a
+         pipe.  Any bytes appended to FILE meanwhile are still read
+         below, up to end of file.  */
+      if (output_file && fileno (output_file) >= 0)
+        copied = copy_file_in_kernel (file, st.st_size);
+#endif /* KERNEL_COPY */
+      if (!copied && st.st_size > COPY_BUFFER_SIZE)
+        wanted = (st.st_size < MAXIMUM_COPY_BUFFER_SIZE
+                  ? st.st_size : MAXIMUM_COPY_BUFFER_SIZE);
+    }
+  if (buffer_size < wanted)
+    {
+      free (buffer);
+      buffer = xcharalloc (wanted);
+      buffer_size = wanted;
+    }
+
   /* Insert output by big chunks.  */
   while (1)
     {
-      length = fread (buffer, 1, sizeof buffer, file);
+      length = fread (buffer, 1, buffer_size, file);
       if (ferror (file))
         M4ERROR ((EXIT_FAILURE, errno, "error reading inserted file"));
       if (length == 0)
@@ -833,6 +2163,40 @@ insert_file (FILE *file)
     }
 }
 
+#if HAVE_SYS_MMAN_H
+
+/*-------------------------------------------------------------------.
+| Insert FILE, the temporary file of a spilled diversion, into the   |
+| current in-memory diversion by mapping it into memory, which saves |
+| reading it through a buffer first.  Return false if it is too      |
+| small to be worth it or cannot be mapped, to let the caller read   |
+| it instead.                                                        |
+`-------------------------------------------------------------------*/
+
+static bool
+insert_mapped_file (FILE *file)
+{
+  struct stat st;
+  char *map;
+  off_t offset;
+
+  if (output_file || fileno (file) < 0 || fflush (file) != 0
+      || fstat (fileno (file), &st) != 0
+      || st.st_size < COPY_BUFFER_SIZE || (size_t) st.st_size != st.st_size)
+    return false;
+  map = (char *) mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                       fileno (file), 0);
+  if (map == MAP_FAILED)
+    return false;
+  for (offset = 0; offset < st.st_size; offset += INT_MAX)
+    output_text (map + offset, (st.st_size - offset < INT_MAX
+                                ? st.st_size - offset : INT_MAX));
+  munmap (map, st.st_size);
+  return true;
+}
+
+#endif /* HAVE_SYS_MMAN_H */
+
 /*-------------------------------------------------------------------.
 | Insert DIVERSION (but not div0) into the current output file.  The |
 | diversion is NOT placed on the expansion obstack, because it must  |
@@ -843,33 +2207,62 @@ insert_file (FILE *file)
 static void
 insert_diversion_helper (m4_diversion *diversion)
 {
+  diversion_stats *stats = diversion->stats;
+  off_t size;
+
+  stats->undiverts++;
   /* Effectively undivert only if an output stream is active.  */
   if (output_diversion)
     {
       if (diversion->size)
         {
-          if (!output_diversion->u.file)
+          stats->undiverted += diversion->used;
+#if USE_POSIX_THREADS
+          if (output_async && output_diversion == &div0 && !output_file)
+            {
+              /* Asynchronous output has buffers of its own.  */
+              diversion_chunk *chunk;
+              total_buffer_size -= diversion->size;
+              for (chunk = diversion->u.chunks; chunk; chunk = chunk->next)
+                output_text (chunk->text, chunk->used);
+            }
+          else
+#endif
+          if (!output_file)
             {
-              /* Transferring diversion metadata is faster than
-                 copying contents.  */
-              assert (!output_diversion->used && output_diversion != &div0
-                      && !output_file);
-              output_diversion->u.buffer = diversion->u.buffer;
-              output_diversion->size = diversion->size;
-              output_cursor = diversion->u.buffer + diversion->used;
-              output_unused = diversion->size - diversion->used;
-              diversion->u.buffer = NULL;
+              /* Linking the chunks onto the current diversion is
+                 faster than copying contents.  The total in-memory
+                 size does not change.  */
+              diversion_chunk *tail;
+              assert (output_diversion != &div0);
+              if (output_diversion->size)
+                {
+                  sync_output_chunk ();
+                  output_diversion->tail->next = diversion->u.chunks;
+                }
+              else
+                output_diversion->u.chunks = diversion->u.chunks;
+              tail = output_diversion->tail = diversion->tail;
+              output_diversion->size += diversion->size;
+              output_diversion->used += diversion->used;
+              if (output_diversion->size > output_diversion->stats->peak_size)
+                output_diversion->stats->peak_size = output_diversion->size;
+              output_cursor = tail->text + tail->used;
+              output_unused = tail->size - tail->used;
+              diversion->u.chunks = NULL;
+              diversion->tail = NULL;
+              diversion->size = 0;
+              diversion->used = 0;
             }
           else
             {
-              /* Avoid double-charging the total in-memory size when
-                 transferring from one in-memory diversion to
-                 another.  */
               total_buffer_size -= diversion->size;
-              output_text (diversion->u.buffer, diversion->used);
+              if (!write_chunks (output_file, diversion->u.chunks))
+                M4ERROR ((EXIT_FAILURE, errno,
+                          "ERROR: copying inserted file"));
             }
         }
-      else if (!output_diversion->u.file)
+      else if (!output_diversion->size && !output_diversion->u.file)
         {
           /* Transferring diversion metadata is faster than copying
              contents.  */
@@ -880,13 +2273,22 @@ insert_diversion_helper (m4_diversion *diversion)
           output_diversion->used = 1;
           output_file = output_diversion->u.file;
           diversion->u.file = NULL;
-          diversion->size = 1;
+          diversion->used = 0;
+          size = m4_tmpsize (output_file);
+          if (size > 0)
+            stats->undiverted += size;
         }
       else
         {
           if (!diversion->u.file)
             diversion->u.file = m4_tmpopen (diversion->divnum, true);
-          insert_file (diversion->u.file);
+          size = m4_tmpsize (diversion->u.file);
+          if (size > 0)
+            stats->undiverted += size;
+#if HAVE_SYS_MMAN_H
+          if (!insert_mapped_file (diversion->u.file))
+#endif
+            insert_file (diversion->u.file);
         }
 
       output_current_line = -1;
@@ -897,10 +2299,12 @@ insert_diversion_helper (m4_diversion *diversion)
     {
       if (!output_diversion)
         total_buffer_size -= diversion->size;
-      free (diversion->u.buffer);
+      free_chunks (diversion->u.chunks);
+      diversion->u.chunks = NULL;
+      diversion->tail = NULL;
       diversion->size = 0;
     }
-  else
+  else if (diversion->used)
     {
       if (diversion->u.file)
         {
@@ -987,19 +2391,19 @@ freeze_diversions (FILE *file)
       if (diversion->size || diversion->used)
         {
           if (diversion->size)
-            xfprintf (file, "D%d,%d\n", diversion->divnum, diversion->used);
+            xfprintf (file, "D%d,%lu\n", diversion->divnum,
+                      (unsigned long int) diversion->used);
           else
             {
-              struct stat file_stat;
+              off_t size;
               diversion->u.file = m4_tmpopen (diversion->divnum, true);
-              if (fstat (fileno (diversion->u.file), &file_stat) < 0)
+              size = m4_tmpsize (diversion->u.file);
+              if (size < 0)
                 M4ERROR ((EXIT_FAILURE, errno, "cannot stat diversion"));
-              if (file_stat.st_size < 0
-                  || (file_stat.st_size + 0UL
-                      != (unsigned long int) file_stat.st_size))
+              if (size + 0UL != (unsigned long int) size)
                 M4ERROR ((EXIT_FAILURE, 0, "diversion too large"));
               xfprintf (file, "D%d,%lu\n", diversion->divnum,
-                        (unsigned long int) file_stat.st_size);
+                        (unsigned long int) size);
             }
 
           insert_diversion_helper (diversion);
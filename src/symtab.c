@@ -20,16 +20,24 @@
 */
 
 /* This file handles all the low level work around the symbol table.  The
-   symbol table is a simple chained hash table.  Each symbol is described
-   by a struct symbol, which is placed in the hash table based upon the
-   symbol name.  Symbols that hash to the same entry in the table are
-   kept on a list, sorted by name.  As a special case, to facilitate the
-   "pushdef" and "popdef" builtins, a symbol can be several times in the
-   symbol table, one for each definition.  Since the name is the same,
-   all the entries for the symbol will be on the same list, and will
-   also, because the list is sorted, be adjacent.  All the entries for a
-   name are simply ordered on the list by age.  The current definition
-   will then always be the first found.  */
+   symbol table is an open addressing hash table with linear probing.
+   Each slot of the table records the full hash value and the length of
+   a name, so that most mismatches are rejected without looking at the
+   name itself, and points to the struct symbol describing the current
+   definition of that name.  As a special case, to facilitate the
+   "pushdef" and "popdef" builtins, a name can have several
+   definitions.  The slot then owns a stack of them: the older
+   definitions are marked as "shadowed" and chained from the current
+   one, youngest first, so they never take up room in the table or slow
+   down the lookup of other names.  All the definitions of a name share
+   a single copy of it, so pushing and popping one only allocates or
+   frees the struct symbol itself.
+
+   The table starts out with hash_table_size slots (rounded up to a
+   power of two), and grows whenever it becomes three quarters full.
+   Deleted names leave a marker behind, so that the iteration of
+   hack_all_symbols () is not disturbed by deletions; the markers are
+   dropped the next time the table is rebuilt.  */
 
 #include "m4.h"
 #include <limits.h>
@@ -41,13 +49,15 @@
 struct profile
 {
   int entry; /* Number of times lookup_symbol called with this mode.  */
-  int comparisons; /* Number of times strcmp was called.  */
-  int misses; /* Number of times strcmp did not return 0.  */
+  int probes; /* Number of occupied slots examined.  */
+  int comparisons; /* Number of times names were compared.  */
+  int misses; /* Number of times names did not match.  */
   long long bytes; /* Number of bytes compared.  */
 };
 
 static struct profile profiles[5];
 static symbol_lookup current_mode;
+static int table_rebuilds;
 
 /* On exit, show a profile of symbol table performance.  */
 static void
@@ -56,55 +66,77 @@ show_profile (void)
   int i;
   for (i = 0; i < 5; i++)
     {
-      xfprintf(stderr, "m4: lookup mode %d called %d times, %d compares, "
-               "%d misses, %lld bytes\n",
-               i, profiles[i].entry, profiles[i].comparisons,
-               profiles[i].misses, profiles[i].bytes);
+      xfprintf(stderr, "m4: lookup mode %d called %d times, %d probes, "
+               "%d compares, %d misses, %lld bytes\n",
+               i, profiles[i].entry, profiles[i].probes,
+               profiles[i].comparisons, profiles[i].misses,
+               profiles[i].bytes);
     }
+  xfprintf(stderr, "m4: symbol table rebuilt %d times\n", table_rebuilds);
 }
 
-/* Like strcmp (S1, S2), but also track profiling statistics.  */
+/* Like memcmp (S1, S2, LEN), but also track profiling statistics.  */
 static int
-profile_strcmp (const char *s1, const char *s2)
+profile_memcmp (const char *s1, const char *s2, size_t len)
 {
-  int i = 1;
-  int result;
-  while (*s1 && *s1 == *s2)
-    {
-      s1++;
-      s2++;
-      i++;
-    }
-  result = (unsigned char) *s1 - (unsigned char) *s2;
+  int result = memcmp (s1, s2, len);
   profiles[current_mode].comparisons++;
   if (result != 0)
     profiles[current_mode].misses++;
-  profiles[current_mode].bytes += i;
+  profiles[current_mode].bytes += len;
   return result;
 }
 
-# define strcmp profile_strcmp
+# define memcmp profile_memcmp
 #endif /* DEBUG_SYM */
 
-
+/* One slot of the symbol table.  SYM is NULL if the slot has never
+   been used, and DELETED_SLOT if its name has been removed.  */
+struct symbol_slot
+{
+  size_t hash;                  /* hash value of the name */
+  size_t len;                   /* length of the name */
+  symbol *sym;                  /* current definition of the name */
+};
+
+typedef struct symbol_slot symbol_slot;
+
+/* Marker for a slot whose name has been deleted.  */
+static symbol deleted_symbol;
+#define DELETED_SLOT (&deleted_symbol)
+
+/* True if SLOT holds a name.  */
+#define SLOT_IN_USE(Slot) \
+  ((Slot)->sym != NULL && (Slot)->sym != DELETED_SLOT)
+
+/* The symbol table, its size (a power of two), the number of names it
+   holds, and the number of slots that are not empty, which includes
+   the deleted ones.  */
+static symbol_slot *symtab;
+static size_t symtab_size;
+static size_t symtab_names;
+static size_t symtab_used;
+
+/* Bumped by every lookup_symbol () call that adds a name to the table,
+   removes one from it, or changes which struct symbol it maps to, so
+   that lookups cached elsewhere can tell they are stale.  */
+unsigned long symtab_generation = 1;
+
+
 /*------------------------------------------------------------------.
 | Initialise the symbol table, by allocating the necessary storage, |
-| and zeroing all the entries.                                      |
+| and zeroing all the entries.  The size given by -H is only a      |
+| starting point, since the table grows on demand.                  |
 `------------------------------------------------------------------*/
 
-/* Pointer to symbol table.  */
-symbol **symtab;
-
 void
 symtab_init (void)
 {
-  size_t i;
-  symbol **s;
-
-  s = symtab = (symbol **) xnmalloc (hash_table_size, sizeof (symbol *));
-
-  for (i = 0; i < hash_table_size; i++)
-    s[i] = NULL;
+  symtab_size = 16;
+  while (symtab_size < hash_table_size && symtab_size <= SIZE_MAX / 4
+         / sizeof (symbol_slot))
+    symtab_size *= 2;
+  symtab = (symbol_slot *) xcalloc (symtab_size, sizeof (symbol_slot));
 
 #ifdef DEBUG_SYM
   {
@@ -116,23 +148,179 @@ symtab_init (void)
 #endif /* DEBUG_SYM */
 }
 
-/*--------------------------------------------------.
-| Return a hashvalue for a string, from GNU-emacs.  |
-`--------------------------------------------------*/
+/*-------------------------------------------------------------------.
+| Return a hash value for the LEN bytes at TEXT, varied by SEED.     |
+| The text is consumed a whole word at a time, each word being mixed |
+| in with a rotation and a multiplication by a large odd constant,   |
+| so that names sharing a long prefix still spread well.  The high   |
+| order bits, which the multiplications mix best, are then folded    |
+| into the low order bits that are used to index tables.             |
+|                                                                    |
+| The work is split so that text can be hashed as it is read:        |
+| hash_words () mixes the whole words of LEN bytes at TEXT into VAL, |
+| which starts as the seed, and hash_finish () mixes in the last     |
+| REST bytes at TEXT, fewer than a word, and the total length LEN.   |
+`-------------------------------------------------------------------*/
 
-static size_t
-hash (const char *s)
+#if SIZE_MAX > 0xffffffff
+# define HASH_MULTIPLIER ((size_t) 0x9e3779b97f4a7c15ULL)
+#else
+# define HASH_MULTIPLIER ((size_t) 0x9e3779b9UL)
+#endif
+#define HASH_BITS (sizeof (size_t) * CHAR_BIT)
+#define HASH_MIX(Val, Word) \
+  (((((Val) << 5) | ((Val) >> (HASH_BITS - 5))) ^ (Word)) * HASH_MULTIPLIER)
+
+size_t
+hash_words (size_t val, const char *text, size_t len)
 {
-  register size_t val = 0;
-
-  register const char *ptr = s;
-  register char ch;
+  size_t word;
 
-  while ((ch = *ptr++) != '\0')
-    val = (val << 7) + (val >> (sizeof (val) * CHAR_BIT - 7)) + ch;
+  while (len >= sizeof word)
+    {
+      memcpy (&word, text, sizeof word);
+      val = HASH_MIX (val, word);
+      text += sizeof word;
+      len -= sizeof word;
+    }
   return val;
 }
 
+size_t
+hash_finish (size_t val, const char *text, size_t rest, size_t len)
+{
+  size_t word;
+
+  if (rest > 0)
+    {
+      word = 0;
+      memcpy (&word, text, rest);
+      val = HASH_MIX (val, word);
+    }
+  val ^= len;
+  return val ^ (val >> (HASH_BITS / 2));
+}
+
+size_t
+hash_text (const char *text, size_t len, size_t seed)
+{
+  size_t rest = len % sizeof (size_t);
+
+  return hash_finish (hash_words (seed, text, len - rest),
+                      text + len - rest, rest, len);
+}
+
+/*------------------------------------------------------------------.
+| Return the slot of the symbol table holding NAME, of length LEN   |
+| and hash value H.  If NAME is not in the table, return the slot   |
+| where it should be inserted instead, which is either empty or a   |
+| deleted slot.                                                     |
+`------------------------------------------------------------------*/
+
+static symbol_slot *
+find_slot (const char *name, size_t len, size_t h)
+{
+  size_t mask = symtab_size - 1;
+  size_t i = h & mask;
+  symbol_slot *deleted = NULL;
+  symbol_slot *slot;
+
+  while (1)
+    {
+      slot = &symtab[i];
+      if (slot->sym == NULL)
+        return deleted != NULL ? deleted : slot;
+      if (slot->sym == DELETED_SLOT)
+        {
+          if (deleted == NULL)
+            deleted = slot;
+        }
+      else
+        {
+#ifdef DEBUG_SYM
+          profiles[current_mode].probes++;
+#endif /* DEBUG_SYM */
+          if (slot->hash == h && slot->len == len
+              && memcmp (SYMBOL_NAME (slot->sym), name, len) == 0)
+            return slot;
+        }
+      i = (i + 1) & mask;
+    }
+}
+
+/*-------------------------------------------------------------------.
+| Make room for one more name in the symbol table.  When the table   |
+| is three quarters full, rebuild it, dropping the deleted slots,    |
+| and doubling its size if more than half of the slots hold names.   |
+`-------------------------------------------------------------------*/
+
+static void
+reserve_slot (void)
+{
+  symbol_slot *old = symtab;
+  size_t old_size = symtab_size;
+  size_t i;
+
+  if ((symtab_used + 1) * 4 <= symtab_size * 3)
+    return;
+
+  if ((symtab_names + 1) * 2 > symtab_size)
+    {
+      if (symtab_size > SIZE_MAX / 2 / sizeof (symbol_slot))
+        xalloc_die ();
+      symtab_size *= 2;
+    }
+  symtab = (symbol_slot *) xcalloc (symtab_size, sizeof (symbol_slot));
+  for (i = 0; i < old_size; i++)
+    if (SLOT_IN_USE (&old[i]))
+      {
+        size_t mask = symtab_size - 1;
+        size_t j = old[i].hash & mask;
+        while (symtab[j].sym != NULL)
+          j = (j + 1) & mask;
+        symtab[j] = old[i];
+      }
+  symtab_used = symtab_names;
+  free (old);
+
+#ifdef DEBUG_SYM
+  table_rebuilds++;
+#endif /* DEBUG_SYM */
+}
+
+/*-------------------------------------------------------------------.
+| Return the name of SYM, with an extra reference for a new symbol.  |
+`-------------------------------------------------------------------*/
+
+static shared_text *
+share_name (symbol *sym)
+{
+  sym->name->refs++;
+  return sym->name;
+}
+
+/*-----------------------------------------------------------------.
+| Allocate a new, undefined, symbol with the name NAME, taking over |
+| one reference to it.                                             |
+`-----------------------------------------------------------------*/
+
+static symbol *
+new_symbol (shared_text *name)
+{
+  symbol *sym = (symbol *) xmalloc (sizeof (symbol));
+  SYMBOL_TYPE (sym) = TOKEN_VOID;
+  SYMBOL_TRACED (sym) = false;
+  sym->name = name;
+  SYMBOL_SHADOWED (sym) = false;
+  SYMBOL_MACRO_ARGS (sym) = false;
+  SYMBOL_BLIND_NO_ARGS (sym) = false;
+  SYMBOL_DELETED (sym) = false;
+  SYMBOL_PENDING_EXPANSIONS (sym) = 0;
+  SYMBOL_PIECES (sym) = NULL;
+  SYMBOL_NEXT (sym) = NULL;
+  return sym;
+}
+
 /*--------------------------------------------.
 | Free all storage associated with a symbol.  |
 `--------------------------------------------*/
@@ -144,60 +332,55 @@ free_symbol (symbol *sym)
     SYMBOL_DELETED (sym) = true;
   else
     {
-      free (SYMBOL_NAME (sym));
+      release_shared_text (sym->name);
       if (SYMBOL_TYPE (sym) == TOKEN_TEXT)
         free (SYMBOL_TEXT (sym));
+      free (SYMBOL_PIECES (sym));
       free (sym);
     }
 }
 
 /*-------------------------------------------------------------------.
 | Search in, and manipulation of the symbol table, are all done by   |
-| lookup_symbol ().  It basically hashes NAME to a list in the       |
-| symbol table, and searches this list for the first occurrence of a |
-| symbol with the name.                                              |
+| lookup_symbol ().  It basically hashes NAME to a slot in the       |
+| symbol table, and probes the following slots until it finds NAME   |
+| or an empty slot.  lookup_hashed_symbol () is the same, for a NAME |
+| whose length LEN and hash_text () value H are already known.       |
 |                                                                    |
 | The MODE parameter determines what lookup_symbol () will do.  It   |
 | can either just do a lookup, do a lookup and insert if not         |
-| present, do an insertion even if the name is already in the list,  |
-| delete the first occurrence of the name on the list, or delete all |
-| occurrences of the name on the list.                               |
+| present, push a new definition even if the name is already         |
+| defined, delete the current definition of the name, or delete all  |
+| of its definitions.                                                |
 `-------------------------------------------------------------------*/
 
 symbol *
 lookup_symbol (const char *name, symbol_lookup mode)
 {
-  size_t h;
-  int cmp = 1;
-  symbol *sym, *prev;
-  symbol **spp;
+  size_t len = strlen (name);
+
+  return lookup_hashed_symbol (name, len, hash_text (name, len, 0), mode);
+}
+
+symbol *
+lookup_hashed_symbol (const char *name, size_t len, size_t h,
+                      symbol_lookup mode)
+{
+  symbol_slot *slot;
+  symbol *sym;
 
 #if DEBUG_SYM
   current_mode = mode;
   profiles[mode].entry++;
 #endif /* DEBUG_SYM */
 
-  h = hash (name);
-  sym = symtab[h % hash_table_size];
-
-  for (prev = NULL; sym != NULL; prev = sym, sym = sym->next)
-    {
-      cmp = strcmp (SYMBOL_NAME (sym), name);
-      if (cmp >= 0)
-        break;
-    }
-
-  /* If just searching, return status of search.  */
-
-  if (mode == SYMBOL_LOOKUP)
-    return cmp == 0 ? sym : NULL;
-
-  /* Symbol not found.  */
-
-  spp = (prev != NULL) ?  &prev->next : &symtab[h % hash_table_size];
+  slot = find_slot (name, len, h);
+  sym = SLOT_IN_USE (slot) ? slot->sym : NULL;
 
   switch (mode)
     {
+    case SYMBOL_LOOKUP:
+      return sym;
 
     case SYMBOL_INSERT:
 
@@ -206,26 +389,19 @@ lookup_symbol (const char *name, symbol_lookup mode)
          a new one; if not, just return the symbol.  If not found, just
          insert the name, and return the new symbol.  */
 
-      if (cmp == 0 && sym != NULL)
+      if (sym != NULL)
         {
           if (SYMBOL_PENDING_EXPANSIONS (sym) > 0)
             {
               symbol *old = sym;
               SYMBOL_DELETED (old) = true;
 
-              sym = (symbol *) xmalloc (sizeof (symbol));
-              SYMBOL_TYPE (sym) = TOKEN_VOID;
+              sym = new_symbol (share_name (old));
               SYMBOL_TRACED (sym) = SYMBOL_TRACED (old);
-              SYMBOL_NAME (sym) = xstrdup (name);
-              SYMBOL_SHADOWED (sym) = false;
-              SYMBOL_MACRO_ARGS (sym) = false;
-              SYMBOL_BLIND_NO_ARGS (sym) = false;
-              SYMBOL_DELETED (sym) = false;
-              SYMBOL_PENDING_EXPANSIONS (sym) = 0;
-
               SYMBOL_NEXT (sym) = SYMBOL_NEXT (old);
               SYMBOL_NEXT (old) = NULL;
-              (*spp) = sym;
+              slot->sym = sym;
+              symtab_generation++;
             }
           return sym;
         }
@@ -237,25 +413,28 @@ lookup_symbol (const char *name, symbol_lookup mode)
          with the name, insert this in front of it, and mark the old
          symbol as "shadowed".  */
 
-      sym = (symbol *) xmalloc (sizeof (symbol));
-      SYMBOL_TYPE (sym) = TOKEN_VOID;
-      SYMBOL_TRACED (sym) = false;
-      SYMBOL_NAME (sym) = xstrdup (name);
-      SYMBOL_SHADOWED (sym) = false;
-      SYMBOL_MACRO_ARGS (sym) = false;
-      SYMBOL_BLIND_NO_ARGS (sym) = false;
-      SYMBOL_DELETED (sym) = false;
-      SYMBOL_PENDING_EXPANSIONS (sym) = 0;
-
-      SYMBOL_NEXT (sym) = *spp;
-      (*spp) = sym;
-
-      if (mode == SYMBOL_PUSHDEF && cmp == 0)
+      symtab_generation++;
+      if (sym == NULL)
         {
-          SYMBOL_SHADOWED (SYMBOL_NEXT (sym)) = true;
-          SYMBOL_TRACED (sym) = SYMBOL_TRACED (SYMBOL_NEXT (sym));
+          if (slot->sym == NULL)
+            {
+              reserve_slot ();
+              slot = find_slot (name, len, h);
+              if (slot->sym == NULL)
+                symtab_used++;
+            }
+          symtab_names++;
+          slot->hash = h;
+          slot->len = len;
+          slot->sym = new_symbol (make_shared_text (name, len));
+          return slot->sym;
         }
-      return sym;
+
+      slot->sym = new_symbol (share_name (sym));
+      SYMBOL_NEXT (slot->sym) = sym;
+      SYMBOL_SHADOWED (sym) = true;
+      SYMBOL_TRACED (slot->sym) = SYMBOL_TRACED (sym);
+      return slot->sym;
 
     case SYMBOL_DELETE:
     case SYMBOL_POPDEF:
@@ -267,13 +446,13 @@ lookup_symbol (const char *name, symbol_lookup mode)
          definition is still in use, let the caller free the memory
          after it is done with the symbol.  */
 
-      if (cmp != 0 || sym == NULL)
+      if (sym == NULL)
         return NULL;
+      symtab_generation++;
       {
         bool traced = false;
-        if (SYMBOL_NEXT (sym) != NULL
-            && SYMBOL_SHADOWED (SYMBOL_NEXT (sym))
-            && mode == SYMBOL_POPDEF)
+        shared_text *st = share_name (sym);
+        if (SYMBOL_NEXT (sym) != NULL && mode == SYMBOL_POPDEF)
           {
             SYMBOL_SHADOWED (SYMBOL_NEXT (sym)) = false;
             SYMBOL_TRACED (SYMBOL_NEXT (sym)) = SYMBOL_TRACED (sym);
@@ -282,31 +461,26 @@ lookup_symbol (const char *name, symbol_lookup mode)
           traced = SYMBOL_TRACED (sym);
         do
           {
-            *spp = SYMBOL_NEXT (sym);
+            slot->sym = SYMBOL_NEXT (sym);
             free_symbol (sym);
-            sym = *spp;
+            sym = slot->sym;
           }
-        while (*spp != NULL && SYMBOL_SHADOWED (*spp)
-               && mode == SYMBOL_DELETE);
-        if (traced)
+        while (sym != NULL && mode == SYMBOL_DELETE);
+        if (sym == NULL)
           {
-            sym = (symbol *) xmalloc (sizeof (symbol));
-            SYMBOL_TYPE (sym) = TOKEN_VOID;
-            SYMBOL_TRACED (sym) = true;
-            SYMBOL_NAME (sym) = xstrdup (name);
-            SYMBOL_SHADOWED (sym) = false;
-            SYMBOL_MACRO_ARGS (sym) = false;
-            SYMBOL_BLIND_NO_ARGS (sym) = false;
-            SYMBOL_DELETED (sym) = false;
-            SYMBOL_PENDING_EXPANSIONS (sym) = 0;
-
-            SYMBOL_NEXT (sym) = *spp;
-            (*spp) = sym;
+            if (traced)
+              {
+                slot->sym = new_symbol (st);
+                SYMBOL_TRACED (slot->sym) = true;
+                return NULL;
+              }
+            slot->sym = DELETED_SLOT;
+            symtab_names--;
           }
+        release_shared_text (st);
       }
       return NULL;
 
-    case SYMBOL_LOOKUP:
     default:
       M4ERROR ((warning_status, 0,
                 "INTERNAL ERROR: invalid mode to symbol_lookup ()"));
@@ -318,7 +492,8 @@ lookup_symbol (const char *name, symbol_lookup mode)
 | The following function is used for the cases where we want to do |
 | something to each and every symbol in the table.  The function   |
 | hack_all_symbols () traverses the symbol table, and calls a      |
-| specified function FUNC for each symbol in the table.  FUNC is   |
+| specified function FUNC for each symbol in the table, including  |
+| the shadowed definitions of each name, youngest first.  FUNC is  |
 | called with a pointer to the symbol, and the DATA argument.      |
 |                                                                  |
 | FUNC may safely call lookup_symbol with mode SYMBOL_POPDEF or    |
@@ -332,19 +507,21 @@ hack_all_symbols (hack_symbol *func, void *data)
   symbol *sym;
   symbol *next;
 
-  for (h = 0; h < hash_table_size; h++)
+  for (h = 0; h < symtab_size; h++)
     {
       /* We allow func to call SYMBOL_POPDEF, which can invalidate
          sym, so we must grab the next element to traverse before
          calling func.  */
-      for (sym = symtab[h]; sym != NULL; sym = next)
+      if (!SLOT_IN_USE (&symtab[h]))
+        continue;
+      for (sym = symtab[h].sym; sym != NULL; sym = next)
         {
           next = SYMBOL_NEXT (sym);
           func (sym, data);
         }
     }
 }
-
+
 #ifdef DEBUG_SYM
 
 static void symtab_print_list (int i);
@@ -386,16 +563,17 @@ symtab_print_list (int i)
   size_t h;
 
   xprintf ("Symbol dump #%d:\n", i);
-  for (h = 0; h < hash_table_size; h++)
-    for (sym = symtab[h]; sym != NULL; sym = sym->next)
-      xprintf ("\tname %s, bucket %lu, addr %p, next %p, "
-               "flags%s%s%s, pending %d\n",
-               SYMBOL_NAME (sym),
-               (unsigned long int) h, sym, SYMBOL_NEXT (sym),
-               SYMBOL_TRACED (sym) ? " traced" : "",
-               SYMBOL_SHADOWED (sym) ? " shadowed" : "",
-               SYMBOL_DELETED (sym) ? " deleted" : "",
-               SYMBOL_PENDING_EXPANSIONS (sym));
+  for (h = 0; h < symtab_size; h++)
+    if (SLOT_IN_USE (&symtab[h]))
+      for (sym = symtab[h].sym; sym != NULL; sym = sym->next)
+        xprintf ("\tname %s, slot %lu, addr %p, next %p, "
+                 "flags%s%s%s, pending %d\n",
+                 SYMBOL_NAME (sym),
+                 (unsigned long int) h, sym, SYMBOL_NEXT (sym),
+                 SYMBOL_TRACED (sym) ? " traced" : "",
+                 SYMBOL_SHADOWED (sym) ? " shadowed" : "",
+                 SYMBOL_DELETED (sym) ? " deleted" : "",
+                 SYMBOL_PENDING_EXPANSIONS (sym));
 }
 
 #endif /* DEBUG_SYM */